@@ -0,0 +1,152 @@
+// arena.h
+#pragma once
+
+#include "basic.h"
+#include "string.h"
+
+namespace theta
+{
+
+    // A "bump pointer" allocator that carves allocations out of
+    // large blocks, and releases all of them in one step.
+    //
+    // Nothing allocated from an arena gets its destructor run,
+    // so it should only be used for objects that don't own
+    // any other resources.
+    //
+struct MemoryArena
+{
+public:
+    enum
+    {
+        kDefaultBlockSize = 64 * 1024,
+    };
+
+    MemoryArena()
+    {}
+
+    explicit MemoryArena(Size blockSize)
+        : _blockSize(blockSize)
+    {}
+
+    ~MemoryArena()
+    {
+        reset();
+    }
+
+    MemoryArena(MemoryArena const&) = delete;
+    MemoryArena& operator=(MemoryArena const&) = delete;
+
+    void* allocate(Size size, Size alignment = sizeof(void*))
+    {
+        _allocatedSize += size;
+
+        // Large requests get a block of their own, so that they
+        // don't waste whatever is left of the current block.
+        //
+        if (size > _blockSize / 4)
+        {
+            return alignUp(allocateBlock(size + alignment, true), alignment);
+        }
+
+        // Aligning can carry the cursor past the end of the block,
+        // so compare against the end before taking the difference.
+        //
+        char* cursor = alignUp(_cursor, alignment);
+        if (!cursor || cursor > _end || size > Size(_end - cursor))
+        {
+            _cursor = allocateBlock(_blockSize, false);
+            _end = _cursor + _blockSize;
+            cursor = alignUp(_cursor, alignment);
+        }
+
+        _cursor = cursor + size;
+        return cursor;
+    }
+
+    template<typename T>
+    T* allocateArray(Count count)
+    {
+        return (T*) allocate(count * sizeof(T), alignof(T));
+    }
+
+    char* allocateString(StringSpan const& text)
+    {
+        Size size = text.getSize();
+        char* buffer = allocateArray<char>(size + 1);
+        memcpy(buffer, text.getData(), size);
+        buffer[size] = 0;
+        return buffer;
+    }
+
+        // Release all of the memory allocated from this arena
+    void reset()
+    {
+        Block* block = _blocks;
+        while (block)
+        {
+            Block* next = block->_next;
+            free(block);
+            block = next;
+        }
+
+        _blocks = nullptr;
+        _cursor = nullptr;
+        _end = nullptr;
+        _allocatedSize = 0;
+        _reservedSize = 0;
+    }
+
+        // Bytes handed out to clients (excluding alignment padding)
+    Size getAllocatedSize() const { return _allocatedSize; }
+
+        // Bytes requested from the system allocator
+    Size getReservedSize() const { return _reservedSize; }
+
+private:
+    struct Block
+    {
+        Block* _next;
+    };
+
+    static char* alignUp(char* ptr, Size alignment)
+    {
+        return (char*)((uintptr_t(ptr) + alignment - 1) & ~uintptr_t(alignment - 1));
+    }
+
+    char* allocateBlock(Size dataSize, bool isDedicated)
+    {
+        Block* block = (Block*) malloc(sizeof(Block) + dataSize);
+        if (!block)
+            throw std::bad_alloc();
+
+        _reservedSize += sizeof(Block) + dataSize;
+
+        // A dedicated block is linked in *behind* the current
+        // block, so that we keep bumping through the current one.
+        //
+        if (isDedicated && _blocks)
+        {
+            block->_next = _blocks->_next;
+            _blocks->_next = block;
+        }
+        else
+        {
+            block->_next = _blocks;
+            _blocks = block;
+        }
+
+        return (char*)(block + 1);
+    }
+
+    Size _blockSize = kDefaultBlockSize;
+
+    Block* _blocks = nullptr;
+    char* _cursor = nullptr;
+    char* _end = nullptr;
+
+    Size _allocatedSize = 0;
+    Size _reservedSize = 0;
+};
+
+}
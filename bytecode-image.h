@@ -0,0 +1,621 @@
+// bytecode-image.h
+#pragma once
+
+#include "bytecode.h"
+#include "source-manager.h"
+#include "verify.h"
+
+namespace theta
+{
+namespace bytecode
+{
+
+    // On-disk images of a compiled program (a tree of `BCDecl`s), so
+    // that a program can be run without compiling it again.
+    //
+    // An image is a header followed by sections of fixed-size records
+    // that refer to one another by index rather than by pointer:
+    //
+    // * symbols: the text of each name, as a range of the strings section
+    // * decls: in breadth-first order, so that the program is decl zero
+    //   and the members of each decl have consecutive indices
+    // * members: decl indices, with each decl's members in one range
+    // * constants
+    // * bytes: the code of every chunk, back to back
+    // * strings
+    //
+    // Every section starts on an 8-byte boundary, so records can be
+    // read in place from a mapped file. Images use the byte order of
+    // the machine that wrote them, and are only accepted by a build
+    // with the same format version and instruction set.
+    //
+enum
+{
+    kBCImageVersion = 6,
+    kBCImageByteOrderMark = 0x01020304,
+    kBCImageNoIndex = 0xFFFFFFFF,
+};
+
+static const char kBCImageMagic[8] = { 'T', 'H', 'E', 'T', 'A', 'B', 'C', 0 };
+
+struct BCImageHeader
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byteOrderMark;
+    uint32_t    opcodeCount;
+
+    uint32_t    symbolCount;
+    uint32_t    declCount;
+    uint32_t    memberCount;
+    uint32_t    constantCount;
+    uint32_t    byteCount;
+    uint32_t    stringSize;
+    uint32_t    reserved;
+
+    uint64_t    symbolsOffset;
+    uint64_t    declsOffset;
+    uint64_t    membersOffset;
+    uint64_t    constantsOffset;
+    uint64_t    bytesOffset;
+    uint64_t    stringsOffset;
+};
+
+struct BCImageSymbol
+{
+    uint32_t    textOffset;
+    uint32_t    textSize;
+};
+
+struct BCImageChunk
+{
+    uint32_t    byteOffset;
+    uint32_t    byteCount;
+    uint32_t    constantOffset;
+    uint32_t    constantCount;
+};
+
+struct BCImageDecl
+{
+    uint32_t        name;           // symbol index, or `kBCImageNoIndex`
+    uint32_t        parent;         // decl index, or `kBCImageNoIndex`
+    uint32_t        firstMember;
+    uint32_t        memberCount;
+    uint64_t        slotCount;
+    BCImageChunk    initCode;
+    BCImageChunk    bodyCode;
+};
+
+struct BCImageConstant
+{
+    enum class Kind : uint32_t
+    {
+        Null,
+        Int,
+        Symbol,     // `payload` is a symbol index
+    };
+
+    Kind        kind;
+    uint32_t    reserved;
+    int64_t     payload;
+};
+
+    // Writing
+
+struct BCImageWriter
+{
+    void write(FILE* file, BCDecl* program)
+    {
+        collect(program);
+
+        BCImageHeader header = {};
+        memcpy(header.magic, kBCImageMagic, sizeof(header.magic));
+        header.version = kBCImageVersion;
+        header.byteOrderMark = kBCImageByteOrderMark;
+        header.opcodeCount = kOpcodeCount;
+
+        header.symbolCount = checkedCount(_symbols.size());
+        header.declCount = checkedCount(_decls.size());
+        header.memberCount = checkedCount(_members.size());
+        header.constantCount = checkedCount(_constants.size());
+        header.byteCount = checkedCount(_bytes.size());
+        header.stringSize = checkedCount(_strings.size());
+
+        uint64_t offset = sizeof(BCImageHeader);
+        header.symbolsOffset    = reserveSection(offset, _symbols.size() * sizeof(BCImageSymbol));
+        header.declsOffset      = reserveSection(offset, _decls.size() * sizeof(BCImageDecl));
+        header.membersOffset    = reserveSection(offset, _members.size() * sizeof(uint32_t));
+        header.constantsOffset  = reserveSection(offset, _constants.size() * sizeof(BCImageConstant));
+        header.bytesOffset      = reserveSection(offset, _bytes.size());
+        header.stringsOffset    = reserveSection(offset, _strings.size());
+
+        _file = file;
+        _offset = 0;
+        writeSection(0, &header, sizeof(header));
+        writeSection(header.symbolsOffset, _symbols.data(), _symbols.size() * sizeof(BCImageSymbol));
+        writeSection(header.declsOffset, _decls.data(), _decls.size() * sizeof(BCImageDecl));
+        writeSection(header.membersOffset, _members.data(), _members.size() * sizeof(uint32_t));
+        writeSection(header.constantsOffset, _constants.data(), _constants.size() * sizeof(BCImageConstant));
+        writeSection(header.bytesOffset, _bytes.data(), _bytes.size());
+        writeSection(header.stringsOffset, _strings.data(), _strings.size());
+    }
+
+private:
+    void collect(BCDecl* program)
+    {
+        std::vector<BCDecl*> queue;
+        queue.push_back(program);
+
+        for (size_t i = 0; i < queue.size(); i++)
+        {
+            BCDecl* decl = queue[i];
+
+            BCImageDecl record = {};
+            record.name = addSymbol(decl->name);
+            record.parent = kBCImageNoIndex;
+            record.slotCount = decl->_slotCount;
+            record.initCode = addChunk(decl->initCode);
+            record.bodyCode = addChunk(decl->bodyCode);
+
+            record.firstMember = checkedCount(_members.size());
+            record.memberCount = checkedCount(decl->_members.size());
+            for (auto member : decl->_members)
+            {
+                _members.push_back(checkedCount(queue.size()));
+                queue.push_back(member);
+            }
+
+            _decls.push_back(record);
+        }
+
+        // Every member was queued by its parent, so the member
+        // ranges also tell us each decl's parent.
+        //
+        for (uint32_t i = 0; i < _decls.size(); i++)
+        {
+            BCImageDecl const& parent = _decls[i];
+            for (uint32_t m = 0; m < parent.memberCount; m++)
+                _decls[_members[parent.firstMember + m]].parent = i;
+        }
+    }
+
+    uint32_t addSymbol(Symbol* symbol)
+    {
+        if (!symbol)
+            return kBCImageNoIndex;
+
+        auto found = _symbolIndices.find(symbol);
+        if (found != _symbolIndices.end())
+            return found->second;
+
+        BCImageSymbol record;
+        record.textOffset = checkedCount(_strings.size());
+        record.textSize = checkedCount(symbol->text.getSize());
+        _strings.insert(_strings.end(), symbol->text._begin, symbol->text._end);
+
+        uint32_t index = checkedCount(_symbols.size());
+        _symbols.push_back(record);
+        _symbolIndices.insert(std::make_pair(symbol, index));
+        return index;
+    }
+
+    BCImageChunk addChunk(CodeChunk const& chunk)
+    {
+        BCImageChunk record;
+        record.byteOffset = checkedCount(_bytes.size());
+        record.byteCount = checkedCount(chunk._bytes.size());
+        record.constantOffset = checkedCount(_constants.size());
+        record.constantCount = checkedCount(chunk._constants.size());
+
+        _bytes.insert(_bytes.end(), chunk._bytes.begin(), chunk._bytes.end());
+        for (auto value : chunk._constants)
+            _constants.push_back(encodeConstant(value));
+
+        return record;
+    }
+
+    BCImageConstant encodeConstant(Value value)
+    {
+        BCImageConstant record = {};
+        if (value.isNull())
+        {
+            record.kind = BCImageConstant::Kind::Null;
+        }
+        else if (value.isInt())
+        {
+            record.kind = BCImageConstant::Kind::Int;
+            record.payload = value.getInt();
+        }
+        else if (auto symbol = as<Symbol>(value.getObj()))
+        {
+            record.kind = BCImageConstant::Kind::Symbol;
+            record.payload = addSymbol(symbol);
+        }
+        else
+        {
+            error(SourceLoc(), "cannot write a constant of this kind to a bytecode image");
+        }
+        return record;
+    }
+
+    static uint32_t checkedCount(size_t count)
+    {
+        if (count >= kBCImageNoIndex)
+            error(SourceLoc(), "program is too large for a bytecode image");
+        return uint32_t(count);
+    }
+
+    static uint64_t reserveSection(uint64_t& offset, size_t size)
+    {
+        offset = (offset + 7) & ~uint64_t(7);
+        uint64_t sectionOffset = offset;
+        offset += size;
+        return sectionOffset;
+    }
+
+    void writeSection(uint64_t offset, void const* data, size_t size)
+    {
+        static const char kPadding[8] = {};
+        assert(offset >= _offset && offset - _offset < 8);
+        writeBytes(kPadding, size_t(offset - _offset));
+        writeBytes(data, size);
+    }
+
+    void writeBytes(void const* data, size_t size)
+    {
+        if (size && fwrite(data, 1, size, _file) != size)
+            error(SourceLoc(), "failed to write bytecode image");
+        _offset += size;
+    }
+
+    std::vector<BCImageSymbol> _symbols;
+    std::vector<BCImageDecl> _decls;
+    std::vector<uint32_t> _members;
+    std::vector<BCImageConstant> _constants;
+    std::vector<Byte> _bytes;
+    std::vector<char> _strings;
+
+    std::map<Symbol*, uint32_t> _symbolIndices;
+
+    FILE* _file = nullptr;
+    uint64_t _offset = 0;
+};
+
+void saveBCImage(char const* path, BCDecl* program)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        error(SourceLoc(), "could not open '%s' for writing", path);
+
+    try
+    {
+        BCImageWriter writer;
+        writer.write(file, program);
+    }
+    catch (...)
+    {
+        fclose(file);
+        throw;
+    }
+
+    if (fclose(file) != 0)
+        error(SourceLoc(), "failed to write bytecode image '%s'", path);
+}
+
+    // Loading
+
+    // The decls of a loaded image, which are allocated in one block.
+    //
+    // Nothing refers back into the image data once it is loaded, so
+    // the file can be unmapped as soon as `loadBCImage` returns.
+    //
+struct BCImage
+{
+    BCImage()
+    {}
+
+    ~BCImage()
+    {
+        delete[] _decls;
+    }
+
+    BCImage(BCImage const&) = delete;
+    BCImage& operator=(BCImage const&) = delete;
+
+    BCDecl* getProgram() { return _decls; }
+
+    BCDecl* _decls = nullptr;
+    Count _declCount = 0;
+};
+
+bool isBCImage(StringSpan const& data)
+{
+    return data.getSize() >= sizeof(kBCImageMagic)
+        && memcmp(data.getData(), kBCImageMagic, sizeof(kBCImageMagic)) == 0;
+}
+
+struct BCImageReader
+{
+    BCImage* read(StringSpan const& data)
+    {
+        open(data);
+        return readImage();
+    }
+
+        // Check the header and sections of the image in `data`, which
+        // must stay mapped for as long as decls are read from it.
+    void open(StringSpan const& data)
+    {
+        _data = data.getData();
+        _size = data.getSize();
+
+        if (_size < sizeof(BCImageHeader) || !isBCImage(data))
+            invalid("missing header");
+
+        BCImageHeader const& header = *(BCImageHeader const*) _data;
+        if (header.version != kBCImageVersion)
+            error(SourceLoc(), "bytecode image has version %u, expected %u", header.version, unsigned(kBCImageVersion));
+        if (header.byteOrderMark != kBCImageByteOrderMark)
+            invalid("wrong byte order");
+        if (header.opcodeCount != kOpcodeCount)
+            invalid("instruction set mismatch");
+        if (header.declCount == 0)
+            invalid("no program");
+
+        _symbols = getSection<BCImageSymbol>(header.symbolsOffset, header.symbolCount);
+        _decls = getSection<BCImageDecl>(header.declsOffset, header.declCount);
+        _members = getSection<uint32_t>(header.membersOffset, header.memberCount);
+        _constants = getSection<BCImageConstant>(header.constantsOffset, header.constantCount);
+        _bytes = getSection<Byte>(header.bytesOffset, header.byteCount);
+        _strings = getSection<char>(header.stringsOffset, header.stringSize);
+        _header = &header;
+
+        // Intern every symbol once, up front.
+        //
+        _symbolTable.resize(header.symbolCount);
+        for (uint32_t i = 0; i < header.symbolCount; i++)
+        {
+            BCImageSymbol const& symbol = _symbols[i];
+            checkRange(symbol.textOffset, symbol.textSize, header.stringSize);
+
+            char const* text = _strings + symbol.textOffset;
+            _symbolTable[i] = getSymbol(StringSpan(text, text + symbol.textSize));
+        }
+    }
+
+    Count getDeclCount() const { return _header->declCount; }
+
+        // Read every decl in the image
+    BCImage* readImage()
+    {
+        BCImageHeader const& header = *_header;
+
+        BCImage* image = new BCImage();
+        try
+        {
+            image->_declCount = header.declCount;
+            image->_decls = new BCDecl[header.declCount];
+
+            for (uint32_t i = 0; i < header.declCount; i++)
+            {
+                BCDecl* decl = &image->_decls[i];
+                BCImageDecl const& record = readDecl(decl, i);
+
+                if (record.parent != kBCImageNoIndex)
+                    decl->parent = &image->_decls[record.parent];
+                for (uint32_t m = 0; m < record.memberCount; m++)
+                    decl->_members[m] = &image->_decls[_members[record.firstMember + m]];
+            }
+
+            // The section structure being sound doesn't make the code
+            // in it safe to run, so check that too. Every decl is
+            // checked, since a compilation cache can reuse any of them.
+            //
+            BytecodeVerifier verifier;
+            for (uint32_t i = 0; i < header.declCount; i++)
+                verifier.verifyDecl(&image->_decls[i]);
+        }
+        catch (...)
+        {
+            delete image;
+            throw;
+        }
+        return image;
+    }
+
+        // Read the decl at `index`, and everything under it, on its
+        // own (for a compilation cache, which only wants some of the
+        // decls in an image), and verify their code.
+        //
+        // The decls read are appended to `decls`, starting with the
+        // one at `index` (which is left without a parent), and their
+        // indices in the image to `indices`. They are appended as they
+        // are allocated, so that the caller can free them on an error.
+        //
+    void readDeclTree(uint32_t index, std::vector<BCDecl*>& decls, std::vector<uint32_t>& indices)
+    {
+        checkIndex(index, _header->declCount);
+
+        size_t first = decls.size();
+        decls.push_back(new BCDecl());
+        indices.push_back(index);
+        for (size_t i = first; i < decls.size(); i++)
+        {
+            BCDecl* decl = decls[i];
+            BCImageDecl const& record = readDecl(decl, indices[i]);
+
+            for (uint32_t m = 0; m < record.memberCount; m++)
+            {
+                BCDecl* member = new BCDecl();
+                decls.push_back(member);
+                indices.push_back(_members[record.firstMember + m]);
+
+                member->parent = decl;
+                decl->_members[m] = member;
+            }
+        }
+
+        // Code can refer to the slots of the parts it is nested in, so
+        // the decls are verified with stand-ins for their ancestors,
+        // which have the only thing the verifier looks at: slot counts.
+        //
+        std::vector<BCDecl> ancestors;
+        for (uint32_t child = index; _decls[child].parent != kBCImageNoIndex; child = _decls[child].parent)
+        {
+            checkIndex(_decls[child].parent, child);
+
+            ancestors.emplace_back();
+            ancestors.back()._slotCount = size_t(_decls[_decls[child].parent].slotCount);
+        }
+        for (size_t i = 0; i + 1 < ancestors.size(); i++)
+            ancestors[i].parent = &ancestors[i + 1];
+
+        BCDecl* root = decls[first];
+        root->parent = ancestors.empty() ? nullptr : &ancestors[0];
+
+        BytecodeVerifier verifier;
+        for (size_t i = first; i < decls.size(); i++)
+            verifier.verifyDecl(decls[i]);
+
+        root->parent = nullptr;
+    }
+
+private:
+        // Read the fields and code of the decl at `index` into `decl`,
+        // checking (but not filling in) its parent and members, and
+        // return its record.
+    BCImageDecl const& readDecl(BCDecl* decl, uint32_t index)
+    {
+        BCImageDecl const& record = _decls[index];
+
+        decl->name = getSymbolAt(record.name);
+        decl->_slotCount = size_t(record.slotCount);
+
+        // Only the program has no parent, and a parent always comes
+        // before its members.
+        //
+        if ((record.parent == kBCImageNoIndex) != (index == 0))
+            invalid("bad parent");
+        if (record.parent != kBCImageNoIndex)
+            checkIndex(record.parent, index);
+
+        // Decls are in breadth-first order, and each is listed as a
+        // member only by its own parent, so the members of a decl
+        // always come after it (and the decls form a tree).
+        //
+        checkRange(record.firstMember, record.memberCount, _header->memberCount);
+        decl->_members.resize(record.memberCount);
+        for (uint32_t m = 0; m < record.memberCount; m++)
+        {
+            uint32_t memberIndex = _members[record.firstMember + m];
+            checkIndex(memberIndex, _header->declCount);
+            if (memberIndex <= index || (m != 0 && memberIndex <= _members[record.firstMember + m - 1]))
+                invalid("members out of order");
+            if (_decls[memberIndex].parent != index)
+                invalid("member with the wrong parent");
+        }
+
+        readChunk(decl->initCode, record.initCode);
+        readChunk(decl->bodyCode, record.bodyCode);
+        return record;
+    }
+
+    void readChunk(CodeChunk& chunk, BCImageChunk const& record)
+    {
+        checkRange(record.byteOffset, record.byteCount, _header->byteCount);
+        checkRange(record.constantOffset, record.constantCount, _header->constantCount);
+
+        Byte const* bytes = _bytes + record.byteOffset;
+        chunk._bytes.assign(bytes, bytes + record.byteCount);
+
+        readConstants(chunk._constants, record.constantOffset, record.constantCount);
+    }
+
+    void readConstants(std::vector<Value>& values, uint32_t offset, uint32_t count)
+    {
+        values.resize(count);
+        for (uint32_t i = 0; i < count; i++)
+            values[i] = readConstant(_constants[offset + i]);
+    }
+
+    Value readConstant(BCImageConstant const& record)
+    {
+        switch (record.kind)
+        {
+        case BCImageConstant::Kind::Null:
+            return Value();
+
+        case BCImageConstant::Kind::Int:
+            if (!Value::canBeImmediateInt(Int(record.payload)))
+                invalid("integer constant out of range");
+            return Value::fromInt(Int(record.payload));
+
+        case BCImageConstant::Kind::Symbol:
+            if (record.payload < 0 || record.payload >= kBCImageNoIndex)
+                invalid("bad symbol index");
+            return Value(getSymbolAt(uint32_t(record.payload)));
+
+        default:
+            invalid("unknown constant kind");
+            return Value();
+        }
+    }
+
+    Symbol* getSymbolAt(uint32_t index)
+    {
+        if (index == kBCImageNoIndex)
+            return nullptr;
+        checkIndex(index, _header->symbolCount);
+        return _symbolTable[index];
+    }
+
+    template<typename T>
+    T const* getSection(uint64_t offset, uint32_t count)
+    {
+        if (offset % alignof(T) != 0 || offset > _size || uint64_t(count) * sizeof(T) > _size - offset)
+            invalid("section out of bounds");
+        return (T const*)(_data + offset);
+    }
+
+    void checkIndex(uint32_t index, uint32_t count)
+    {
+        if (index >= count)
+            invalid("index out of range");
+    }
+
+    void checkRange(uint32_t offset, uint32_t count, uint32_t total)
+    {
+        if (offset > total || count > total - offset)
+            invalid("range out of bounds");
+    }
+
+    void invalid(char const* reason)
+    {
+        error(SourceLoc(), "invalid bytecode image (%s)", reason);
+    }
+
+    char const* _data = nullptr;
+    size_t _size = 0;
+
+    BCImageHeader const* _header = nullptr;
+    BCImageSymbol const* _symbols = nullptr;
+    BCImageDecl const* _decls = nullptr;
+    uint32_t const* _members = nullptr;
+    BCImageConstant const* _constants = nullptr;
+    Byte const* _bytes = nullptr;
+    char const* _strings = nullptr;
+
+    std::vector<Symbol*> _symbolTable;
+};
+
+    // Load an image from `data` (typically a mapped file, as from
+    // `loadSourceFile`), which is not needed after this returns.
+    //
+BCImage* loadBCImage(StringSpan const& data)
+{
+    BCImageReader reader;
+    return reader.read(data);
+}
+
+}
+}
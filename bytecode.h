@@ -12,31 +12,247 @@ namespace bytecode
 {
 typedef uint8_t Byte;
 
+#define FOREACH_OPCODE(X)               \
+    X(Nop)                              \
+    X(Return)                           \
+    X(Constant)                         \
+    X(CreateObject)                     \
+                                        \
+    X(Pop)                              \
+                                        \
+    X(GetPartSlot)                      \
+    X(SetPartSlot)                      \
+    X(GetSelfSlot)                      \
+    X(SetSelfSlot)                      \
+    X(GetOuterSlot)                     \
+    X(GetOuterPart)                     \
+    X(GetOuterPartOf)                   \
+                                        \
+    X(CreatePatternFromMainPart)        \
+    X(CreatePatternFromBaseAndMainPart) \
+    X(CreateMemberPattern)              \
+    X(CreateMemberPatternFromBase)      \
+    X(GetEmptyPattern)                  \
+                                        \
+    X(GetSelfPart)                      \
+    X(GetObjectFromPart)                \
+    X(GetPartFromObject)                \
+    X(GetMixinFromPart)                 \
+    X(GetOriginPartFromMixin)           \
+    X(GetBasePart)                      \
+                                        \
+    X(Inner)                            \
+                                        \
+    X(Wide)                             \
+    /* end */
+
 enum class Opcode : Byte
 {
-    Nop,
-    Return,
-    Constant,
-    CreateObject,
+#define DECLARE_OPCODE(NAME) NAME,
+    FOREACH_OPCODE(DECLARE_OPCODE)
+#undef DECLARE_OPCODE
+};
 
-    Pop,
+enum
+{
+#define COUNT_OPCODE(NAME) +1
+    kOpcodeCount = 0 FOREACH_OPCODE(COUNT_OPCODE),
+#undef COUNT_OPCODE
+};
 
-    GetPartSlot,
-    SetPartSlot,
+    // Instruction operands (slot and constant indices) are a single
+    // byte, which keeps decoding in the interpreter as cheap as
+    // possible for the common case.
+    //
+    // An operand that doesn't fit is encoded by putting a `Wide`
+    // prefix before the opcode, in which case the operand is instead
+    // an unsigned LEB128 integer: seven bits per byte, low bits
+    // first, with the high bit set on every byte but the last.
+    //
+enum
+{
+    kMaxNarrowOperand   = 0xFF,
 
-    CreatePatternFromMainPart,
-    CreatePatternFromBaseAndMainPart,
-    GetEmptyPattern,
+    kOperandContinueBit = 0x80,
+    kOperandValueMask   = 0x7F,
+    kMaxWideOperandSize = (sizeof(unsigned int) * 8 + 6) / 7,
+};
 
-    GetSelfPart,
-    GetObjectFromPart,
-    GetPartFromObject,
-    GetMixinFromPart,
-    GetOriginPartFromMixin,
+inline void encodeWideOperand(std::vector<Byte>& bytes, unsigned int value)
+{
+    while (value > kOperandValueMask)
+    {
+        bytes.push_back(Byte((value & kOperandValueMask) | kOperandContinueBit));
+        value >>= 7;
+    }
+    bytes.push_back(Byte(value));
+}
 
-    Inner,
+    // Decode the wide operand at `cursor`, and advance past it
+inline unsigned int decodeWideOperand(Byte const*& cursor)
+{
+    unsigned int value = 0;
+    for (unsigned int shift = 0;; shift += 7)
+    {
+        Byte byte = *cursor++;
+        value |= (unsigned int)(byte & kOperandValueMask) << shift;
+        if (!(byte & kOperandContinueBit))
+            return value;
+    }
+}
+
+inline unsigned int decodeOperand(Byte const*& cursor, bool isWide)
+{
+    if (isWide)
+        return decodeWideOperand(cursor);
+    return *cursor++;
+}
+
+inline Count getOperandCount(Opcode opcode)
+{
+    switch (opcode)
+    {
+    case Opcode::Constant:
+    case Opcode::GetPartSlot:
+    case Opcode::SetPartSlot:
+    case Opcode::GetSelfSlot:
+    case Opcode::SetSelfSlot:
+    case Opcode::GetOuterPart:
+    case Opcode::GetOuterPartOf:
+    case Opcode::CreateMemberPattern:
+    case Opcode::CreateMemberPatternFromBase:
+        return 1;
+
+    case Opcode::GetOuterSlot:
+    case Opcode::GetBasePart:
+        return 2;
+
+    default:
+        return 0;
+    }
+}
+
+    // An instruction and its operands, for code that wants to work
+    // with instructions rather than bytes
+    //
+struct Instruction
+{
+    enum
+    {
+        kMaxOperandCount = 2,
+    };
+
+    Opcode opcode = Opcode::Nop;
+    unsigned int operands[kMaxOperandCount] = {};
 };
 
+    // Decode the instruction at `cursor` (including any `Wide`
+    // prefix) into `instruction`, and advance past it
+    //
+inline void decodeInstruction(Byte const*& cursor, Instruction& instruction)
+{
+    instruction.opcode = Opcode(*cursor++);
+
+    bool isWide = false;
+    if (instruction.opcode == Opcode::Wide)
+    {
+        instruction.opcode = Opcode(*cursor++);
+        isWide = true;
+    }
+
+    Count operandCount = getOperandCount(instruction.opcode);
+    for (Index i = 0; i < operandCount; i++)
+        instruction.operands[i] = decodeOperand(cursor, isWide);
+}
+
+    // Decode the instruction at `cursor` into `instruction` like
+    // `decodeInstruction`, but for bytes that might not be well formed
+    // (such as code read from a file), which end at `end`.
+    //
+    // An unknown opcode, a `Wide` prefix on an instruction without
+    // operands, or an instruction cut off by `end` is an error.
+    //
+inline void decodeCheckedInstruction(Byte const*& cursor, Byte const* end, Instruction& instruction)
+{
+    if (cursor == end)
+        error(SourceLoc(), "invalid bytecode (missing instruction)");
+
+    Byte opcodeByte = *cursor++;
+
+    bool isWide = false;
+    if (opcodeByte == Byte(Opcode::Wide))
+    {
+        if (cursor == end)
+            error(SourceLoc(), "invalid bytecode (missing instruction after wide prefix)");
+        opcodeByte = *cursor++;
+        isWide = true;
+    }
+
+    if (opcodeByte >= kOpcodeCount || opcodeByte == Byte(Opcode::Wide))
+        error(SourceLoc(), "invalid bytecode (bad opcode %u)", unsigned(opcodeByte));
+    instruction.opcode = Opcode(opcodeByte);
+
+    Count operandCount = getOperandCount(instruction.opcode);
+    if (isWide && operandCount == 0)
+        error(SourceLoc(), "invalid bytecode (wide prefix on an instruction without operands)");
+
+    for (Index i = 0; i < operandCount; i++)
+    {
+        if (!isWide)
+        {
+            if (cursor == end)
+                error(SourceLoc(), "invalid bytecode (truncated operand)");
+            instruction.operands[i] = *cursor++;
+            continue;
+        }
+
+        unsigned int value = 0;
+        for (unsigned int byteIndex = 0;; byteIndex++)
+        {
+            if (cursor == end)
+                error(SourceLoc(), "invalid bytecode (truncated operand)");
+            if (byteIndex == kMaxWideOperandSize)
+                error(SourceLoc(), "invalid bytecode (operand too large)");
+
+            Byte byte = *cursor++;
+            unsigned int shift = 7 * byteIndex;
+            if (shift + 7 > sizeof(unsigned int) * 8 && (byte & kOperandValueMask) >> (sizeof(unsigned int) * 8 - shift))
+                error(SourceLoc(), "invalid bytecode (operand too large)");
+            value |= (unsigned int)(byte & kOperandValueMask) << shift;
+            if (!(byte & kOperandContinueBit))
+                break;
+        }
+        instruction.operands[i] = value;
+    }
+}
+
+    // Append `instruction` to `bytes`, with a `Wide` prefix if
+    // any of its operands don't fit in a byte
+    //
+inline void encodeInstruction(std::vector<Byte>& bytes, Instruction const& instruction)
+{
+    Count operandCount = getOperandCount(instruction.opcode);
+
+    bool isWide = false;
+    for (Index i = 0; i < operandCount; i++)
+    {
+        if (instruction.operands[i] > kMaxNarrowOperand)
+            isWide = true;
+    }
+
+    if (isWide)
+        bytes.push_back(Byte(Opcode::Wide));
+    bytes.push_back(Byte(instruction.opcode));
+
+    for (Index i = 0; i < operandCount; i++)
+    {
+        if (isWide)
+            encodeWideOperand(bytes, instruction.operands[i]);
+        else
+            bytes.push_back(Byte(instruction.operands[i]));
+    }
+}
+
 struct BCDecl;
 
 struct CodeChunk
@@ -54,6 +270,15 @@ struct CodeChunk
         while(cursor != end)
         {
             Opcode opcode = Opcode(*cursor++);
+
+            bool isWide = false;
+            if (opcode == Opcode::Wide)
+            {
+                printf("WIDE ");
+                opcode = Opcode(*cursor++);
+                isWide = true;
+            }
+
             switch (opcode)
             {
             default:
@@ -74,7 +299,7 @@ struct CodeChunk
                 break;
 
             case Opcode::Constant:
-                printf("CONSANT %d", int(*cursor++));
+                printf("CONSANT %u", decodeOperand(cursor, isWide));
                 break;
 
 
@@ -87,11 +312,35 @@ struct CodeChunk
                 break;
 
             case Opcode::SetPartSlot:
-                printf("SET_PART_SLOT %d", int(*cursor++));
+                printf("SET_PART_SLOT %u", decodeOperand(cursor, isWide));
                 break;
 
             case Opcode::GetPartSlot:
-                printf("GET_PART_SLOT %d", int(*cursor++));
+                printf("GET_PART_SLOT %u", decodeOperand(cursor, isWide));
+                break;
+
+            case Opcode::GetSelfSlot:
+                printf("GET_SELF_SLOT %u", decodeOperand(cursor, isWide));
+                break;
+
+            case Opcode::SetSelfSlot:
+                printf("SET_SELF_SLOT %u", decodeOperand(cursor, isWide));
+                break;
+
+            case Opcode::GetOuterSlot:
+                {
+                    auto levelCount = decodeOperand(cursor, isWide);
+                    auto slotIndex = decodeOperand(cursor, isWide);
+                    printf("GET_OUTER_SLOT %u %u", levelCount, slotIndex);
+                }
+                break;
+
+            case Opcode::GetOuterPart:
+                printf("GET_OUTER_PART %u", decodeOperand(cursor, isWide));
+                break;
+
+            case Opcode::GetOuterPartOf:
+                printf("GET_OUTER_PART_OF %u", decodeOperand(cursor, isWide));
                 break;
 
             case Opcode::CreatePatternFromMainPart:
@@ -102,6 +351,14 @@ struct CodeChunk
                 printf("CREATE_PATTERN_FROM_BASE_AND_MAIN_PART");
                 break;
 
+            case Opcode::CreateMemberPattern:
+                printf("CREATE_MEMBER_PATTERN %u", decodeOperand(cursor, isWide));
+                break;
+
+            case Opcode::CreateMemberPatternFromBase:
+                printf("CREATE_MEMBER_PATTERN_FROM_BASE %u", decodeOperand(cursor, isWide));
+                break;
+
             case Opcode::GetEmptyPattern:
                 printf("GET_EMPTY_PATTERN");
                 break;
@@ -125,6 +382,14 @@ struct CodeChunk
             case Opcode::GetOriginPartFromMixin:
                 printf("GET_ORIGIN_PART_FROM_MIXIN");
                 break;
+
+            case Opcode::GetBasePart:
+                {
+                    auto baseIndex = decodeOperand(cursor, isWide);
+                    auto cacheIndex = decodeOperand(cursor, isWide);
+                    printf("GET_BASE_PART %u (cache %u)", baseIndex, cacheIndex);
+                }
+                break;
             }
             printf("\n");
         }
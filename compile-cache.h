@@ -0,0 +1,552 @@
+// compile-cache.h
+#pragma once
+
+#include "bytecode-image.h"
+#include "syntax.h"
+
+namespace theta
+{
+
+    // A cache of the bytecode emitted for each declaration, kept
+    // between compilations so that only changed declarations need to
+    // be checked and emitted again.
+    //
+    // Each `PatternDeclBase` is keyed by a hash of:
+    //
+    // * its own content (name, bases, members and statements, as
+    //   parsed), which covers the source of the declaration;
+    //
+    // * its position: the path of member indices from the program
+    //   down to it, which determines its slot index and how many
+    //   scopes its code has to walk out through;
+    //
+    // * the *signature* of the whole program: every declaration's
+    //   name, bases and member layout, but not its statements.
+    //
+    // Since a key is only 64 bits, each decl also records the length
+    // of its content (its nodes and the text of their names, standing
+    // in for its source, whose positions the AST doesn't keep), and a
+    // cached decl is only reused if that matches too.
+    //
+    // The signature stands in for the declaration's dependencies: a
+    // lookup can resolve through any enclosing scope, and through the
+    // bases and members of whatever it finds there, so we treat all of
+    // those as dependencies. Editing the statements of one declaration
+    // (the common case) then only invalidates it and its ancestors,
+    // while adding, removing or renaming a declaration invalidates
+    // everything.
+    //
+    // On disk, a cache is a small header and the key and length of
+    // every decl, followed by a bytecode image of the last program
+    // compiled. The keys are in the same (breadth-first) order as the
+    // image's decls.
+    //
+    // Loading a cache only indexes the keys. The bytecode for a decl
+    // (and its members) is read from the image, and verified, when its
+    // key is first found, so an edit to a large program doesn't pay
+    // to load the decls that it compiles again anyway.
+    //
+static const char kCompilationCacheMagic[8] = { 'T', 'H', 'E', 'T', 'A', 'C', 'C', 0 };
+
+struct CompilationCache
+{
+public:
+    enum
+    {
+        kVersion = 2,
+    };
+
+    CompilationCache()
+    {}
+
+    ~CompilationCache()
+    {
+        discard();
+    }
+
+    CompilationCache(CompilationCache const&) = delete;
+    CompilationCache& operator=(CompilationCache const&) = delete;
+
+        // Load the results of an earlier compilation from `path`.
+        //
+        // A missing, stale or damaged cache just leaves this one
+        // empty, so that everything gets compiled.
+        //
+    void load(char const* path)
+    {
+        _file = loadSourceFile(path);
+        if (!_file)
+            return;
+
+        try
+        {
+            loadFromData(_file->_text);
+        }
+        catch (Error const& e)
+        {
+            fprintf(stderr, "warning: ignoring compilation cache '%s': %s\n", path, e.message);
+            discard();
+        }
+        catch (...)
+        {
+            fprintf(stderr, "warning: ignoring compilation cache '%s'\n", path);
+            discard();
+        }
+    }
+
+        // Work out the key of every declaration in `program`.
+        //
+        // This must be called before `program` is checked, since
+        // checking rewrites expressions in place.
+        //
+    void computeKeys(ast::Decl* program)
+    {
+        _signatureHash = hashDecl(program, false);
+        computeKeys(program, kRootPathHash);
+    }
+
+        // The bytecode from an earlier compilation for `decl`, if it
+        // is unchanged (and null otherwise).
+        //
+        // The first call for `decl` reads its bytecode, which later
+        // calls then return. The decls read belong to the caller, and
+        // stay valid after this cache is gone.
+        //
+        // Safe to call from several threads at once.
+        //
+    bytecode::BCDecl* findDecl(ast::Decl* decl)
+    {
+        if (decl->_cacheKey == kNoKey)
+            return nullptr;
+
+        auto foundDecl = _cachedDecls.find(decl->_cacheKey);
+        if (foundDecl == _cachedDecls.end())
+            return nullptr;
+
+        // Decls are read outside of `_mutex`, so that workers reusing
+        // different decls don't wait on one another.
+        //
+        CachedDecl& cachedDecl = foundDecl->second;
+        if (cachedDecl.length != decl->_cacheLength)
+            return nullptr;
+
+        std::call_once(cachedDecl.readOnce, [&]()
+        {
+            cachedDecl.decl = readDecl(cachedDecl.index);
+        });
+        return cachedDecl.decl;
+    }
+
+        // Note that `bcDecl` is the bytecode for `decl` (whether it was
+        // just emitted, or reused from the cache), so that it can be
+        // saved under the right key.
+        //
+        // Safe to call from several threads at once.
+        //
+    void recordDecl(ast::Decl* decl, bytecode::BCDecl* bcDecl, bool isReused)
+    {
+        if (decl->_cacheKey == kNoKey)
+            return;
+
+        DeclKey key = { decl->_cacheKey, decl->_cacheLength };
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _bcDeclKeys[bcDecl] = key;
+        if (isReused)
+            _reusedCount++;
+        else
+            _emittedCount++;
+    }
+
+        // Save `program` (and the keys for its decls) to `path`.
+        //
+        // Nothing more can be found in the cache after this, since
+        // the file it was loaded from (often `path`) is let go first.
+        //
+    void save(char const* path, bytecode::BCDecl* program)
+    {
+        discard();
+
+        // The keys need to be listed in the same order that the
+        // image writer lays out the decls.
+        //
+        std::vector<DeclKey> keys;
+        std::vector<bytecode::BCDecl*> queue;
+        queue.push_back(program);
+        for (size_t i = 0; i < queue.size(); i++)
+        {
+            bytecode::BCDecl* decl = queue[i];
+
+            DeclKey key = { kNoKey, 0 };
+            auto found = _bcDeclKeys.find(decl);
+            if (found != _bcDeclKeys.end())
+                key = found->second;
+            keys.push_back(key);
+
+            for (auto member : decl->_members)
+                queue.push_back(member);
+        }
+
+        FILE* file = fopen(path, "wb");
+        if (!file)
+        {
+            fprintf(stderr, "warning: could not write compilation cache '%s'\n", path);
+            return;
+        }
+
+        try
+        {
+            Header header = {};
+            memcpy(header.magic, kCompilationCacheMagic, sizeof(header.magic));
+            header.version = kVersion;
+            header.declCount = uint32_t(keys.size());
+
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+            ok = ok && fwrite(keys.data(), sizeof(DeclKey), keys.size(), file) == keys.size();
+            if (!ok)
+                error(SourceLoc(), "failed to write compilation cache '%s'", path);
+
+            bytecode::BCImageWriter writer;
+            writer.write(file, program);
+        }
+        catch (...)
+        {
+            fclose(file);
+            throw;
+        }
+        fclose(file);
+    }
+
+        // Statistics for the most recent compilation
+    Count getReusedCount() const { return _reusedCount; }
+    Count getEmittedCount() const { return _emittedCount; }
+
+private:
+    struct Header
+    {
+        char        magic[8];
+        uint32_t    version;
+        uint32_t    declCount;
+    };
+
+    struct DeclKey
+    {
+        uint64_t    hash;
+        uint64_t    length;
+    };
+
+    static const uint64_t kRootPathHash = 0x6a09e667f3bcc909ull;
+    static const uint64_t kNoKey = 0;
+
+    void loadFromData(StringSpan const& data)
+    {
+        if (data.getSize() < sizeof(Header))
+            return;
+
+        Header const& header = *(Header const*) data.getData();
+        if (memcmp(header.magic, kCompilationCacheMagic, sizeof(kCompilationCacheMagic)) != 0 || header.version != kVersion)
+            return;
+
+        size_t keysSize = size_t(header.declCount) * sizeof(DeclKey);
+        if (keysSize > data.getSize() - sizeof(Header))
+            return;
+
+        DeclKey const* keys = (DeclKey const*)(data.getData() + sizeof(Header));
+        StringSpan imageData(data.getData() + sizeof(Header) + keysSize, data._end);
+
+        _reader.open(imageData);
+        if (_reader.getDeclCount() != Count(header.declCount))
+            return;
+
+        _cachedKeys = keys;
+        _cachedDecls.reserve(header.declCount);
+        _bcDeclKeys.reserve(header.declCount);
+        for (uint32_t i = 0; i < header.declCount; i++)
+        {
+            if (keys[i].hash == kNoKey)
+                continue;
+            CachedDecl& cachedDecl = _cachedDecls[keys[i].hash];
+            cachedDecl.index = i;
+            cachedDecl.length = keys[i].length;
+        }
+    }
+
+        // Read the decl at `index` in the image and its members,
+        // returning null if they are damaged (so that they get
+        // compiled again).
+        //
+    bytecode::BCDecl* readDecl(uint32_t index)
+    {
+        std::vector<bytecode::BCDecl*> decls;
+        std::vector<uint32_t> indices;
+        try
+        {
+            _reader.readDeclTree(index, decls, indices);
+        }
+        catch (Error const& e)
+        {
+            for (auto decl : decls)
+                delete decl;
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_hasWarned)
+                fprintf(stderr, "warning: ignoring part of compilation cache '%s': %s\n", _file->_path, e.message);
+            _hasWarned = true;
+            return nullptr;
+        }
+
+        // Members of a reused decl keep their keys, so that they can
+        // still be reused on their own after their parent changes.
+        //
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (size_t i = 0; i < decls.size(); i++)
+        {
+            if (_cachedKeys[indices[i]].hash != kNoKey)
+                _bcDeclKeys[decls[i]] = _cachedKeys[indices[i]];
+        }
+        return decls[0];
+    }
+
+    void discard()
+    {
+        _cachedDecls.clear();
+        _cachedKeys = nullptr;
+        _hasWarned = false;
+        _reader = bytecode::BCImageReader();
+
+        unloadSourceFile(_file);
+        _file = nullptr;
+    }
+
+    // Hashing
+
+    static uint64_t combine(uint64_t hash, uint64_t value)
+    {
+        return hash ^ (value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2));
+    }
+
+    static uint64_t hashSymbol(uint64_t hash, Symbol* symbol)
+    {
+        // Symbols are compared by (the hash of) their text, since
+        // pointers differ from one run to the next.
+        if (!symbol)
+            return combine(hash, 0);
+        return combine(hash, uint64_t(symbol->hash));
+    }
+
+    uint64_t hashExpr(uint64_t hash, ast::Expr* expr)
+    {
+        if (!expr)
+            return combine(hash, 0);
+
+        hash = combine(hash, uint64_t(expr->getTag()) + 1);
+        switch (expr->getTag())
+        {
+        case ast::Node::Tag::NameExpr:
+            return hashSymbol(hash, ((ast::NameExpr*) expr)->_name);
+
+        case ast::Node::Tag::MemberExpr:
+            {
+                auto memberExpr = (ast::MemberExpr*) expr;
+                hash = hashExpr(hash, memberExpr->_base);
+                return hashSymbol(hash, memberExpr->_name);
+            }
+
+        default:
+            // Other expressions are only created by checking
+            return hash;
+        }
+    }
+
+    uint64_t hashStmt(uint64_t hash, ast::Stmt* stmt)
+    {
+        if (!stmt)
+            return combine(hash, 0);
+
+        if (auto seqStmt = ast::as<ast::SeqStmt>(stmt))
+        {
+            hash = combine(hash, uint64_t(stmt->getTag()) + 1);
+            hash = combine(hash, seqStmt->stmts.size());
+            for (auto subStmt : seqStmt->stmts)
+                hash = hashStmt(hash, subStmt);
+            return hash;
+        }
+        if (auto decl = ast::as<ast::Decl>(stmt))
+            return combine(hash, hashDecl(decl, true));
+        if (auto expr = ast::as<ast::Expr>(stmt))
+            return hashExpr(hash, expr);
+
+        return combine(hash, uint64_t(stmt->getTag()) + 1);
+    }
+
+        // Hash `decl`, including statements only if `includeBodies`
+    uint64_t hashDecl(ast::Decl* decl, bool includeBodies)
+    {
+        uint64_t hash = combine(kRootPathHash, uint64_t(decl->getTag()) + 1);
+        hash = hashSymbol(hash, decl->_name);
+
+        if (auto valueDecl = ast::as<ast::ValueDeclBase>(decl))
+        {
+            hash = hashExpr(hash, valueDecl->_typeExpr);
+        }
+        else if (auto patternDecl = ast::as<ast::PatternDeclBase>(decl))
+        {
+            hash = combine(hash, patternDecl->_bases.size());
+            for (auto base : patternDecl->_bases)
+                hash = hashExpr(hash, base);
+
+            hash = combine(hash, patternDecl->_members.size());
+            for (auto member : patternDecl->_members)
+                hash = combine(hash, hashDecl(member, includeBodies));
+
+            if (includeBodies)
+                hash = hashStmt(hash, patternDecl->_bodyStmt);
+        }
+        return hash;
+    }
+
+    // Measuring
+    //
+    // The length of a subtree, for `Decl::_cacheLength`, is one for
+    // each node in it plus the length of each name.
+
+    static uint64_t measureSymbol(Symbol* symbol)
+    {
+        if (!symbol)
+            return 0;
+        return uint64_t(symbol->text.getSize());
+    }
+
+    static uint64_t measureExpr(ast::Expr* expr)
+    {
+        if (!expr)
+            return 0;
+
+        switch (expr->getTag())
+        {
+        case ast::Node::Tag::NameExpr:
+            return 1 + measureSymbol(((ast::NameExpr*) expr)->_name);
+
+        case ast::Node::Tag::MemberExpr:
+            {
+                auto memberExpr = (ast::MemberExpr*) expr;
+                return 1 + measureExpr(memberExpr->_base) + measureSymbol(memberExpr->_name);
+            }
+
+        default:
+            return 1;
+        }
+    }
+
+    static uint64_t measureStmt(ast::Stmt* stmt)
+    {
+        if (!stmt)
+            return 0;
+
+        if (auto seqStmt = ast::as<ast::SeqStmt>(stmt))
+        {
+            uint64_t length = 1;
+            for (auto subStmt : seqStmt->stmts)
+                length += measureStmt(subStmt);
+            return length;
+        }
+        if (auto decl = ast::as<ast::Decl>(stmt))
+            return measureDecl(decl);
+        if (auto expr = ast::as<ast::Expr>(stmt))
+            return measureExpr(expr);
+
+        return 1;
+    }
+
+    static uint64_t measureDecl(ast::Decl* decl)
+    {
+        uint64_t length = 1 + measureSymbol(decl->_name);
+
+        if (auto valueDecl = ast::as<ast::ValueDeclBase>(decl))
+        {
+            length += measureExpr(valueDecl->_typeExpr);
+        }
+        else if (auto patternDecl = ast::as<ast::PatternDeclBase>(decl))
+        {
+            for (auto base : patternDecl->_bases)
+                length += measureExpr(base);
+            for (auto member : patternDecl->_members)
+                length += measureDecl(member);
+            length += measureStmt(patternDecl->_bodyStmt);
+        }
+        return length;
+    }
+
+        // Record keys for `decl` and everything under it, and return
+        // the content hash of `decl`
+    uint64_t computeKeys(ast::Decl* decl, uint64_t pathHash)
+    {
+        uint64_t hash = combine(kRootPathHash, uint64_t(decl->getTag()) + 1);
+        hash = hashSymbol(hash, decl->_name);
+
+        auto patternDecl = ast::as<ast::PatternDeclBase>(decl);
+        if (!patternDecl)
+            return combine(hash, hashDecl(decl, true));
+
+        uint64_t length = 1 + measureSymbol(decl->_name);
+
+        hash = combine(hash, patternDecl->_bases.size());
+        for (auto base : patternDecl->_bases)
+        {
+            hash = hashExpr(hash, base);
+            length += measureExpr(base);
+        }
+
+        // Each member's length is worked out along with its key, so
+        // that members aren't measured again for every ancestor.
+        //
+        hash = combine(hash, patternDecl->_members.size());
+        for (size_t i = 0; i < patternDecl->_members.size(); i++)
+        {
+            ast::Decl* member = patternDecl->_members[i];
+            uint64_t memberPathHash = combine(pathHash, i + 1);
+            hash = combine(hash, computeKeys(member, memberPathHash));
+            length += ast::as<ast::PatternDeclBase>(member) ? member->_cacheLength : measureDecl(member);
+        }
+
+        hash = hashStmt(hash, patternDecl->_bodyStmt);
+        length += measureStmt(patternDecl->_bodyStmt);
+
+        uint64_t key = combine(combine(_signatureHash, pathHash), hash);
+        if (key == kNoKey)
+            key = 1;
+        decl->_cacheKey = key;
+        decl->_cacheLength = length;
+
+        return hash;
+    }
+
+    // State
+
+    struct CachedDecl
+    {
+        uint32_t index = 0;
+        uint64_t length = 0;
+        std::once_flag readOnce;
+        bytecode::BCDecl* decl = nullptr;
+    };
+
+        // The loaded cache, and its decls by key
+    SourceFile* _file = nullptr;
+    bytecode::BCImageReader _reader;
+    DeclKey const* _cachedKeys = nullptr;
+    std::unordered_map<uint64_t, CachedDecl> _cachedDecls;
+    bool _hasWarned = false;
+
+        // The signature of the program being compiled (whose decls
+        // have their keys in `Decl::_cacheKey`)
+    uint64_t _signatureHash = 0;
+
+        // Keys for the bytecode of the program being compiled
+    std::mutex _mutex;
+    std::unordered_map<bytecode::BCDecl*, DeclKey> _bcDeclKeys;
+    Count _reusedCount = 0;
+    Count _emittedCount = 0;
+};
+
+}
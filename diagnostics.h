@@ -6,15 +6,41 @@
 namespace theta
 {
 
+    // The exception thrown by `error()`.
+    //
+    // The message is only printed once the error reaches whoever
+    // handles it (see `reportError()`), not when it is thrown. Sibling
+    // tasks can fail at the same time, and `TaskPool::parallelFor`
+    // only re-throws one of their errors, so printing eagerly would
+    // make the output depend on scheduling.
+    //
+struct Error
+{
+    enum
+    {
+        kMaxMessageSize = 1024,
+    };
+
+    SourceLoc loc;
+    char message[kMaxMessageSize];
+};
+
 void error(SourceLoc loc, char const* format, ...)
 {
+    Error e;
+    e.loc = loc;
+
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
-    fprintf(stderr, "\n");
+    vsnprintf(e.message, sizeof(e.message), format, args);
     va_end(args);
 
-    throw 99;
+    throw e;
+}
+
+void reportError(Error const& e)
+{
+    fprintf(stderr, "%s\n", e.message);
 }
 
 
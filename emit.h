@@ -1,7 +1,10 @@
 // emit.h
 #pragma once
 
+#include "compile-cache.h"
+#include "peephole.h"
 #include "syntax.h"
+#include "task-pool.h"
 
 namespace theta
 {
@@ -13,10 +16,26 @@ namespace bytecode
 
 struct Emitter
 {
-    void emitConstantIndex(Value value)
+    Emitter()
+    {}
+
+        // Emit sibling declarations in parallel on `pool`, reusing
+        // bytecode from `cache` for unchanged declarations.
+    explicit Emitter(TaskPool* pool, CompilationCache* cache = nullptr)
+        : _pool(pool)
+        , _cache(cache)
+    {}
+
+    TaskPool* _pool = nullptr;
+    CompilationCache* _cache = nullptr;
+
+        // Run the peephole optimizer over the code of each decl
+    bool _optimize = false;
+
+    void emitConstant(Value value)
     {
         auto constantIndex = addConstant(value);
-        emitUInt(constantIndex);
+        emitOpcode(Opcode::Constant, constantIndex);
     }
 
     void emitOpcode(Opcode opcode)
@@ -24,9 +43,30 @@ struct Emitter
         emitByte(Byte(opcode));
     }
 
-    void emitUInt(unsigned int value)
+        // Emit an instruction with operands, adding a `Wide` prefix
+        // if any of them doesn't fit in a byte.
+    void emitOpcode(Opcode opcode, size_t operand)
+    {
+        Instruction instruction;
+        instruction.opcode = opcode;
+        instruction.operands[0] = checkOperand(operand);
+        encodeInstruction(getChunk()->_bytes, instruction);
+    }
+
+    void emitOpcode(Opcode opcode, size_t operand0, size_t operand1)
+    {
+        Instruction instruction;
+        instruction.opcode = opcode;
+        instruction.operands[0] = checkOperand(operand0);
+        instruction.operands[1] = checkOperand(operand1);
+        encodeInstruction(getChunk()->_bytes, instruction);
+    }
+
+    static unsigned int checkOperand(size_t operand)
     {
-        emitByte(Byte(value));
+        if (operand > UINT32_MAX)
+            error(SourceLoc(), "instruction operand %zu is too large", operand);
+        return (unsigned int) operand;
     }
 
     void emitByte(Byte code)
@@ -34,10 +74,19 @@ struct Emitter
         getChunk()->_bytes.push_back(code);
     }
 
-    int addConstant(Value value)
+        // Add `value` to the pool of the current chunk, if it isn't
+        // there already, and return its index.
+    unsigned int addConstant(Value value)
     {
-        int index = (int) getChunk()->_constants.size();
-        getChunk()->_constants.push_back(value);
+        auto& indices = _chunkStack->_constantIndices;
+        auto found = indices.find(value.getBits());
+        if (found != indices.end())
+            return found->second;
+
+        auto& constants = getChunk()->_constants;
+        unsigned int index = (unsigned int) constants.size();
+        constants.push_back(value);
+        indices.insert(std::make_pair(value.getBits(), index));
         return index;
     }
 
@@ -77,8 +126,12 @@ struct Emitter
     {
         CodeChunk* _chunk = nullptr;
         ChunkBinding* _parent = nullptr;
+
+            // Constants are identified by their bits, so the same
+            // object or integer is only added to the pool once.
+        std::unordered_map<uintptr_t, unsigned int> _constantIndices;
     };
-    ChunkBinding* _chunkStack;
+    ChunkBinding* _chunkStack = nullptr;
 
     struct WithChunk : ChunkBinding
     {
@@ -164,33 +217,40 @@ struct Emitter
         case Expr::Tag::SlotPath:
             {
                 auto path = (SlotExpr*) expr;
+                auto slotIndex = path->_decl->_slotIndex;
+
+                // A slot of `self`, or of a part some number of levels
+                // out from it, is the common case, and gets a single
+                // instruction instead of a walk out followed by a
+                // `GetPartSlot`.
+                //
+                if (auto selfPath = as<SelfExpr>(path->_base))
+                {
+                    auto levelCount = getLevelCount(selfPath);
+                    if (levelCount == 0)
+                        emitOpcode(Opcode::GetSelfSlot, slotIndex);
+                    else
+                        emitOpcode(Opcode::GetOuterSlot, levelCount, slotIndex);
+                    break;
+                }
+
                 emitExpr(path->_base);
-                emitOpcode(Opcode::GetPartSlot);
-                emitUInt(path->_decl->_slotIndex);
+                emitOpcode(Opcode::GetPartSlot, slotIndex);
             }
             break;
 
         case Expr::Tag::SelfPath:
             {
                 auto path = (SelfExpr*)expr;
-                emitOpcode(Opcode::GetSelfPart);
-
-
-                // Now based on number of levels "up", we need
-                // to emit origin ops...
-                auto s = _scope;
-                while (s)
-                {
-                    if (s->_astDecl == path->_decl)
-                    {
-                        break;
-                    }
-
-                    emitOpcode(Opcode::GetMixinFromPart);
-                    emitOpcode(Opcode::GetOriginPartFromMixin);
 
-                    s = s->_parent;
-                }
+                // Based on the number of levels "up", we need to
+                // walk out through the origins of enclosing parts.
+                //
+                auto levelCount = getLevelCount(path);
+                if (levelCount == 0)
+                    emitOpcode(Opcode::GetSelfPart);
+                else
+                    emitOpcode(Opcode::GetOuterPart, levelCount);
             }
             break;
 
@@ -203,8 +263,35 @@ struct Emitter
             }
             break;
 
+        case Expr::Tag::CastToBaseExpr:
+            {
+                // Where the part for a base sits in an object depends
+                // on the pattern the object was created from, so this
+                // is resolved at run time (through an inline cache
+                // that the linker assigns in place of the `0`).
+                //
+                auto path = (CastToBaseExpr*)expr;
+                emitExpr(path->_base);
+                emitOpcode(Opcode::GetBasePart, path->_baseIndex, 0);
+            }
+            break;
+
+
+        }
+    }
 
+        // The number of scopes between the current one and the
+        // one that `path` refers to
+    Count getLevelCount(SelfExpr* path)
+    {
+        Count levelCount = 0;
+        for (auto s = _scope; s; s = s->_parent)
+        {
+            if (s->_astDecl == path->_decl)
+                break;
+            levelCount++;
         }
+        return levelCount;
     }
 
     void emitCreateObject()
@@ -212,10 +299,9 @@ struct Emitter
         emitOpcode(Opcode::CreateObject);
     }
 
-    void emitSetPartSlot(size_t slotIndex)
+    void emitSetSelfSlot(size_t slotIndex)
     {
-        emitOpcode(Opcode::SetPartSlot);
-        emitUInt(slotIndex);
+        emitOpcode(Opcode::SetSelfSlot, slotIndex);
     }
 
     void emitReturn()
@@ -305,7 +391,29 @@ struct Emitter
     {
         if (auto simpleDecl = as<ast::PatternDeclBase>(astDecl))
         {
-            return emitSimpleDecl(simpleDecl);
+            if (_cache)
+            {
+                if (auto cachedDecl = _cache->findDecl(simpleDecl))
+                {
+                    // The cached decl (and its members) can be used as-is,
+                    // apart from the link to its new parent.
+                    //
+                    cachedDecl->parent = getBCDecl();
+                    _cache->recordDecl(simpleDecl, cachedDecl, true);
+                    return cachedDecl;
+                }
+            }
+
+            auto bcDecl = emitSimpleDecl(simpleDecl);
+            if (_optimize)
+            {
+                PeepholeOptimizer optimizer;
+                optimizer.optimizeDecl(bcDecl);
+            }
+
+            if (_cache)
+                _cache->recordDecl(simpleDecl, bcDecl, false);
+            return bcDecl;
         }
         else
         {
@@ -326,11 +434,17 @@ struct Emitter
 
             bcDecl->_slotCount = astDecl->_slotCount;
 
-            for (auto astMember : astDecl->_members)
+            // Each member is emitted into a `BCDecl` of its own, so
+            // siblings can be emitted in parallel. Results are stored
+            // by index, so the output doesn't depend on scheduling.
+            //
+            auto& astMembers = astDecl->_members;
+            bcDecl->_members.resize(astMembers.size());
+            parallelFor(_pool, Count(astMembers.size()), [&](Index i)
             {
-                auto bcMember = emitDecl(astMember);
-                bcDecl->_members.push_back(bcMember);
-            }
+                Emitter memberEmitter(this);
+                bcDecl->_members[i] = memberEmitter.emitDecl(astMembers[i]);
+            });
 
             WithChunk withChunk(this, &bcDecl->bodyCode);
             if (auto stmt = astDecl->_bodyStmt)
@@ -349,6 +463,15 @@ struct Emitter
 
         WithChunk withChunk(this, &bcDecl->initCode);
 
+        // The program itself isn't stored in a slot of anything,
+        // so it has nothing to initialize.
+        //
+        if (astDecl->_slotIndex == size_t(-1))
+        {
+            emitReturn();
+            return bcDecl;
+        }
+
         switch(astDecl->getTag() )
         {
         default:
@@ -360,18 +483,16 @@ struct Emitter
             // then create a value of that type, then install
             // it into the correct slot...
             //
-            emitOpcode(Opcode::GetSelfPart);
             emitPattern(astDecl);
             emitCreateObject();
-            emitSetPartSlot(astDecl->_slotIndex);
+            emitSetSelfSlot(astDecl->_slotIndex);
             break;
 
         case Decl::Tag::PatternDecl:
             // Need to emit the logic that computes the pattern,
             // and then installs it into the correct slot...
-            emitOpcode(Opcode::GetSelfPart);
             emitPattern(astDecl);
-            emitSetPartSlot(astDecl->_slotIndex);
+            emitSetSelfSlot(astDecl->_slotIndex);
             break;
 
         }
@@ -385,6 +506,17 @@ struct Emitter
     {
         return emitDecl(program);
     }
+
+private:
+        // An emitter for one member of the declaration that `parent`
+        // is currently emitting.
+    explicit Emitter(Emitter* parent)
+        : _pool(parent->_pool)
+        , _cache(parent->_cache)
+        , _optimize(parent->_optimize)
+    {
+        _scope = parent->_scope;
+    }
 };
 
 }
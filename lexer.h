@@ -9,33 +9,417 @@ enum
     kEndOfFile = -1,
 };
 
-bool isIdentifierStartChar(int c)
+    // Character classification.
+    //
+    // Every byte value maps to a `CharInfo` entry that says how a
+    // token starting with that byte is lexed (`kind`), which token
+    // it produces when it is a token all by itself (`code`), and
+    // which runs of characters it can continue (`flags`).
+    //
+    // Supporting a new character (digits, more operators, ...) should
+    // only need a new row in `makeCharInfoTable()`, plus a new
+    // `CharKind` if it starts a new kind of token.
+    //
+enum class CharKind : uint8_t
 {
-    return (('a' <= c) && (c <= 'z'))
-        || (('A' <= c) && (c <= 'Z'))
-        || (c == '_');
+    Invalid,
+    Punctuation,
+    Whitespace,
+    Newline,
+    CarriageReturn,
+    Slash,
+    IdentifierStart,
+};
+
+enum CharFlag : uint8_t
+{
+    kCharFlag_Whitespace        = 1 << 0,
+    kCharFlag_IdentifierStart   = 1 << 1,
+    kCharFlag_Identifier        = 1 << 2,
+};
+
+struct CharInfo
+{
+    CharKind    kind;
+    uint8_t     flags;
+    Token::Code code;
+};
+
+struct CharInfoTable
+{
+    enum { kCount = 256 };
+
+    CharInfo entries[kCount];
+};
+
+constexpr CharInfoTable makeCharInfoTable()
+{
+    CharInfoTable table = {};
+    for (int c = 0; c < CharInfoTable::kCount; c++)
+    {
+        table.entries[c] = { CharKind::Invalid, 0, Token::Code::InvalidChar };
+    }
+
+    for (int c = 'a'; c <= 'z'; c++)
+    {
+        table.entries[c] = { CharKind::IdentifierStart, kCharFlag_IdentifierStart | kCharFlag_Identifier, Token::Code::Identifier };
+    }
+    for (int c = 'A'; c <= 'Z'; c++)
+    {
+        table.entries[c] = { CharKind::IdentifierStart, kCharFlag_IdentifierStart | kCharFlag_Identifier, Token::Code::Identifier };
+    }
+    table.entries['_'] = { CharKind::IdentifierStart, kCharFlag_IdentifierStart | kCharFlag_Identifier, Token::Code::Identifier };
+
+    table.entries[' ']  = { CharKind::Whitespace, kCharFlag_Whitespace, Token::Code::Whitespace };
+    table.entries['\t'] = { CharKind::Whitespace, kCharFlag_Whitespace, Token::Code::Whitespace };
+
+    table.entries['\n'] = { CharKind::Newline,        0, Token::Code::Newline };
+    table.entries['\r'] = { CharKind::CarriageReturn, 0, Token::Code::Newline };
+
+    table.entries['/'] = { CharKind::Slash, 0, Token::Code::InfixOperator };
+
+    table.entries['#'] = { CharKind::Punctuation, 0, Token::Code::Hash };
+    table.entries['('] = { CharKind::Punctuation, 0, Token::Code::LParen };
+    table.entries[')'] = { CharKind::Punctuation, 0, Token::Code::RParen };
+    table.entries['{'] = { CharKind::Punctuation, 0, Token::Code::LCurly };
+    table.entries['}'] = { CharKind::Punctuation, 0, Token::Code::RCurly };
+    table.entries[';'] = { CharKind::Punctuation, 0, Token::Code::Semicolon };
+    table.entries[':'] = { CharKind::Punctuation, 0, Token::Code::Colon };
+    table.entries['@'] = { CharKind::Punctuation, 0, Token::Code::At };
+    table.entries['.'] = { CharKind::Punctuation, 0, Token::Code::Dot };
+
+    return table;
+}
+
+static constexpr CharInfoTable kCharInfoTable = makeCharInfoTable();
+
+    // Look up a character as returned by `Lexer::peekChar()`,
+    // which may be `kEndOfFile`.
+inline CharInfo const& getCharInfo(int c)
+{
+    static const CharInfo kEndOfFileInfo = { CharKind::Invalid, 0, Token::Code::EndOfFile };
+    if (unsigned(c) >= unsigned(CharInfoTable::kCount))
+        return kEndOfFileInfo;
+    return kCharInfoTable.entries[c];
+}
+
+inline bool isWhitespaceChar(int c)
+{
+    return (getCharInfo(c).flags & kCharFlag_Whitespace) != 0;
+}
+
+inline bool isIdentifierStartChar(int c)
+{
+    return (getCharInfo(c).flags & kCharFlag_IdentifierStart) != 0;
 }
 
-bool isIdentifierChar(int c)
+inline bool isIdentifierChar(int c)
 {
-    return isIdentifierStartChar(c);
+    return (getCharInfo(c).flags & kCharFlag_Identifier) != 0;
 }
 
+    // Bulk scanners for the lexer's hottest loops.
+    //
+    // Each one returns a pointer to the first character in
+    // `[cursor, end)` that does *not* continue the run being
+    // scanned (or `end`). They never read outside that range.
+    //
+    // `THETA_LEXER_SIMD` selects the implementation: 2 for AVX2,
+    // 1 for SSE2, and 0 for the portable scalar loops.
+    //
+#ifndef THETA_LEXER_SIMD
+#if defined(__AVX2__)
+#define THETA_LEXER_SIMD 2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define THETA_LEXER_SIMD 1
+#else
+#define THETA_LEXER_SIMD 0
+#endif
+#endif
+
+inline unsigned int countTrailingZeros(uint32_t value)
+{
+    assert(value != 0);
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (unsigned int) index;
+#else
+    return (unsigned int) __builtin_ctz(value);
+#endif
+}
+
+#if THETA_LEXER_SIMD >= 2
+
+    // 32-byte blocks
+typedef __m256i CharBlock;
+
+#define CHAR_BLOCK_SIZE                 32
+#define CHAR_BLOCK_LOAD(PTR)            _mm256_loadu_si256((__m256i const*)(PTR))
+#define CHAR_BLOCK_SPLAT(C)             _mm256_set1_epi8(char(C))
+#define CHAR_BLOCK_EQ(A, B)             _mm256_cmpeq_epi8(A, B)
+#define CHAR_BLOCK_GT(A, B)             _mm256_cmpgt_epi8(A, B)
+#define CHAR_BLOCK_OR(A, B)             _mm256_or_si256(A, B)
+#define CHAR_BLOCK_AND(A, B)            _mm256_and_si256(A, B)
+#define CHAR_BLOCK_MASK(A)              uint32_t(_mm256_movemask_epi8(A))
+#define CHAR_BLOCK_FULL_MASK            uint32_t(0xFFFFFFFF)
+
+#elif THETA_LEXER_SIMD >= 1
+
+    // 16-byte blocks
+typedef __m128i CharBlock;
+
+#define CHAR_BLOCK_SIZE                 16
+#define CHAR_BLOCK_LOAD(PTR)            _mm_loadu_si128((__m128i const*)(PTR))
+#define CHAR_BLOCK_SPLAT(C)             _mm_set1_epi8(char(C))
+#define CHAR_BLOCK_EQ(A, B)             _mm_cmpeq_epi8(A, B)
+#define CHAR_BLOCK_GT(A, B)             _mm_cmpgt_epi8(A, B)
+#define CHAR_BLOCK_OR(A, B)             _mm_or_si128(A, B)
+#define CHAR_BLOCK_AND(A, B)            _mm_and_si128(A, B)
+#define CHAR_BLOCK_MASK(A)              uint32_t(_mm_movemask_epi8(A))
+#define CHAR_BLOCK_FULL_MASK            uint32_t(0xFFFF)
+
+#endif
+
+    // Skip spaces and tabs
+inline char const* scanWhitespace(char const* cursor, char const* end)
+{
+#if THETA_LEXER_SIMD
+    CharBlock space = CHAR_BLOCK_SPLAT(' ');
+    CharBlock tab = CHAR_BLOCK_SPLAT('\t');
+    while (end - cursor >= CHAR_BLOCK_SIZE)
+    {
+        CharBlock block = CHAR_BLOCK_LOAD(cursor);
+        uint32_t mask = CHAR_BLOCK_MASK(CHAR_BLOCK_OR(
+            CHAR_BLOCK_EQ(block, space),
+            CHAR_BLOCK_EQ(block, tab)));
+
+        if (mask != CHAR_BLOCK_FULL_MASK)
+            return cursor + countTrailingZeros(~mask);
+        cursor += CHAR_BLOCK_SIZE;
+    }
+#endif
+
+    while (cursor != end && isWhitespaceChar((unsigned char) *cursor))
+        cursor++;
+    return cursor;
+}
+
+    // Skip to the end of the current line (the next `\r` or `\n`)
+inline char const* scanToEndOfLine(char const* cursor, char const* end)
+{
+#if THETA_LEXER_SIMD
+    CharBlock cr = CHAR_BLOCK_SPLAT('\r');
+    CharBlock lf = CHAR_BLOCK_SPLAT('\n');
+    while (end - cursor >= CHAR_BLOCK_SIZE)
+    {
+        CharBlock block = CHAR_BLOCK_LOAD(cursor);
+        uint32_t mask = CHAR_BLOCK_MASK(CHAR_BLOCK_OR(
+            CHAR_BLOCK_EQ(block, cr),
+            CHAR_BLOCK_EQ(block, lf)));
+
+        if (mask)
+            return cursor + countTrailingZeros(mask);
+        cursor += CHAR_BLOCK_SIZE;
+    }
+#endif
+
+    while (cursor != end && *cursor != '\r' && *cursor != '\n')
+        cursor++;
+    return cursor;
+}
+
+    // The test that the SIMD loop in `scanIdentifierChars()` applies
+    // to each byte, written out for one byte at a time (with the byte
+    // compared as a signed char, as `CHAR_BLOCK_GT` does).
+    //
+constexpr bool isIdentifierCharInBlock(int c)
+{
+    int folded = c | 0x20;
+    if (folded >= 0x80)
+        folded -= 0x100;
+    return (folded > 'a' - 1 && 'z' + 1 > folded) || c == '_';
+}
+
+constexpr bool isIdentifierCharInBlockConsistent()
+{
+    for (int c = 0; c < CharInfoTable::kCount; c++)
+    {
+        bool inTable = (kCharInfoTable.entries[c].flags & kCharFlag_Identifier) != 0;
+        if (isIdentifierCharInBlock(c) != inTable)
+            return false;
+    }
+    return true;
+}
+
+static_assert(isIdentifierCharInBlockConsistent(),
+    "scanIdentifierChars() must accept exactly the bytes with kCharFlag_Identifier; update both together");
+
+    // Skip characters for which `isIdentifierChar()` holds
+inline char const* scanIdentifierChars(char const* cursor, char const* end)
+{
+#if THETA_LEXER_SIMD
+    // This must match `kCharFlag_Identifier` in the table, which is
+    // checked above at compile time.
+    //
+    // Folding in the 0x20 bit maps upper-case letters onto lower-case,
+    // so that one (signed) range check covers both. Bytes >= 0x80 are
+    // negative as signed chars, and so fall outside the range.
+    //
+    CharBlock caseBit = CHAR_BLOCK_SPLAT(0x20);
+    CharBlock beforeA = CHAR_BLOCK_SPLAT('a' - 1);
+    CharBlock afterZ = CHAR_BLOCK_SPLAT('z' + 1);
+    CharBlock underscore = CHAR_BLOCK_SPLAT('_');
+    while (end - cursor >= CHAR_BLOCK_SIZE)
+    {
+        CharBlock block = CHAR_BLOCK_LOAD(cursor);
+        CharBlock folded = CHAR_BLOCK_OR(block, caseBit);
+        CharBlock isLetter = CHAR_BLOCK_AND(
+            CHAR_BLOCK_GT(folded, beforeA),
+            CHAR_BLOCK_GT(afterZ, folded));
+        uint32_t mask = CHAR_BLOCK_MASK(CHAR_BLOCK_OR(
+            isLetter,
+            CHAR_BLOCK_EQ(block, underscore)));
+
+        if (mask != CHAR_BLOCK_FULL_MASK)
+            return cursor + countTrailingZeros(~mask);
+        cursor += CHAR_BLOCK_SIZE;
+    }
+#endif
+
+    while (cursor != end && isIdentifierChar((unsigned char) *cursor))
+        cursor++;
+    return cursor;
+}
+
+    // A source of input text that is delivered in chunks,
+    // such as a pipe, or a file read in fixed-size blocks.
+    //
+struct LexerInput
+{
+    virtual ~LexerInput() {}
+
+        // Read up to `capacity` bytes into `buffer`, and return
+        // the number of bytes read (zero at the end of input).
+    virtual size_t read(char* buffer, size_t capacity) = 0;
+};
+
+struct FileLexerInput : LexerInput
+{
+    FileLexerInput(FILE* file)
+        : _file(file)
+    {}
+
+    size_t read(char* buffer, size_t capacity) override
+    {
+        return fread(buffer, 1, capacity, _file);
+    }
+
+    FILE* _file;
+};
+
 struct Lexer
 {
+    enum
+    {
+        kStreamBufferSize = 64 * 1024,
+    };
+
+    Lexer()
+    {}
+
+    Lexer(Lexer const&) = delete;
+    Lexer& operator=(Lexer const&) = delete;
+
+    ~Lexer()
+    {
+        free(_buffer);
+    }
+
+        // Lex text that is entirely resident in memory
     void init(StringSpan const& text)
     {
         _cursor = text._begin;
         _end = text._end;
     }
 
+        // Lex text that is read incrementally from `input`.
+        //
+        // Only a bounded window of the input is kept in memory, so
+        // the `text` of a token returned by `readToken()` is only
+        // valid until the next call. Symbols are unaffected, since
+        // their text is copied when they are interned.
+        //
+    void init(LexerInput* input)
+    {
+        _input = input;
+        _bufferSize = kStreamBufferSize;
+        _buffer = (char*) malloc(_bufferSize);
+        if (!_buffer)
+            throw std::bad_alloc();
+
+        _cursor = _buffer;
+        _end = _buffer;
+    }
+
     SourceLoc getLoc() { return _loc; }
-    bool isAtEnd() { return _cursor == _end; }
+
+    bool isAtEnd()
+    {
+        if (_cursor != _end)
+            return false;
+        return !refill();
+    }
 
     Token readToken();
 
 private:
 
+        // Read more input into the stream buffer, keeping the
+        // text of the current token.
+        //
+        // Returns `false` if there is no more input.
+        //
+    bool refill()
+    {
+        if (!_input)
+            return false;
+
+        // Slide the current token down to the start of the buffer,
+        // discarding everything before it...
+        //
+        size_t keepSize = _end - _tokenStart;
+        if (_tokenStart != _buffer)
+        {
+            memmove(_buffer, _tokenStart, keepSize);
+        }
+
+        // ... and if the token fills most of the buffer, grow it so
+        // that we aren't left reading tiny chunks.
+        //
+        if (keepSize > _bufferSize / 2)
+        {
+            _bufferSize *= 2;
+            char* newBuffer = (char*) realloc(_buffer, _bufferSize);
+            if (!newBuffer)
+                throw std::bad_alloc();
+            _buffer = newBuffer;
+        }
+
+        size_t readSize = _input->read(_buffer + keepSize, _bufferSize - keepSize);
+
+        _cursor = _buffer + (_cursor - _tokenStart);
+        _tokenStart = _buffer;
+        _end = _buffer + keepSize + readSize;
+
+        if (!readSize)
+        {
+            _input = nullptr;
+            return false;
+        }
+        return true;
+    }
+
     Token::Code readTokenImpl(Token::Value& outValue);
 
     Token::Code readLineComment();
@@ -43,17 +427,25 @@ private:
     int peekChar()
     {
         if (isAtEnd()) return kEndOfFile;
-        return *_cursor;
+        return (unsigned char) *_cursor;
     }
     int readChar()
     {
         if (isAtEnd()) return kEndOfFile;
-        return *_cursor++;
+        return (unsigned char) *_cursor++;
     }
 
     SourceLoc _loc;
-    char const* _cursor;
-    char const* _end;
+    char const* _cursor = nullptr;
+    char const* _end = nullptr;
+
+        // Start of the token currently being read
+    char const* _tokenStart = nullptr;
+
+        // State for streaming input (null when lexing resident text)
+    LexerInput* _input = nullptr;
+    char* _buffer = nullptr;
+    size_t _bufferSize = 0;
 };
 
 Token Lexer::readToken()
@@ -61,9 +453,9 @@ Token Lexer::readToken()
     for (;;)
     {
         Token token;
-        token.text._begin = _cursor;
+        _tokenStart = _cursor;
         token.code = readTokenImpl(token.value);
-        token.text._end = _cursor;
+        token.text = StringSpan(_tokenStart, _cursor);
 
         switch (token.code)
         {
@@ -83,6 +475,8 @@ Token::Code Lexer::readLineComment()
 {
     for (;;)
     {
+        _cursor = scanToEndOfLine(_cursor, _end);
+
         int c = peekChar();
         switch (c)
         {
@@ -100,84 +494,74 @@ Token::Code Lexer::readLineComment()
 
 Token::Code Lexer::readTokenImpl(Token::Value& outValue)
 {
-    char const* textStart = _cursor;
     int c = readChar();
-    switch (c)
+    CharInfo const& info = getCharInfo(c);
+    switch (info.kind)
     {
-    case kEndOfFile: return Token::Code::EndOfFile;
+    case CharKind::Punctuation:
+        return info.code;
 
-    case '/':
+    case CharKind::Slash:
         {
-            switch(peekChar())
+            if (peekChar() == '/')
             {
-            case '/':
                 readChar();
                 return readLineComment();
-
-            default:
-                break;
             }
 
-            outValue.symbol = getSymbol(StringSpan(textStart, _cursor));
+            outValue.symbol = getSymbol(StringSpan(_tokenStart, _cursor));
             return Token::Code::InfixOperator;
         }
-        break;
 
-    case '#': return Token::Code::Hash;
-    case '(': return Token::Code::LParen;
-    case ')': return Token::Code::RParen;
-    case '{': return Token::Code::LCurly;
-    case '}': return Token::Code::RCurly;
-    case ';': return Token::Code::Semicolon;
-    case ':': return Token::Code::Colon;
-    case '@': return Token::Code::At;
-    case '.': return Token::Code::Dot;
-
-    case '\n': return Token::Code::Newline;
-    case '\r':
-    {
-        if (peekChar() == '\n')
-            readChar();
+    case CharKind::Newline:
         return Token::Code::Newline;
-    }
 
-#define CASE_WHITESPACE \
-        case ' ': case '\t'
+    case CharKind::CarriageReturn:
+        {
+            if (peekChar() == '\n')
+                readChar();
+            return Token::Code::Newline;
+        }
 
-    CASE_WHITESPACE:
-    {
-        for (;;)
+    case CharKind::Whitespace:
         {
-            switch (peekChar())
+            for (;;)
             {
-            CASE_WHITESPACE:
+                _cursor = scanWhitespace(_cursor, _end);
+
+                // Note: `peekChar()` may refill streaming input, and
+                // so the run of whitespace might continue.
+                //
+                if (!isWhitespaceChar(peekChar()))
+                    break;
                 readChar();
-                continue;
+            }
+            return Token::Code::Whitespace;
+        }
 
-            default:
-                break;
+    case CharKind::IdentifierStart:
+        {
+            for (;;)
+            {
+                _cursor = scanIdentifierChars(_cursor, _end);
+                if (!isIdentifierChar(peekChar()))
+                    break;
+                readChar();
             }
 
-            return Token::Code::Whitespace;
+            outValue.symbol = getSymbol(StringSpan(_tokenStart, _cursor));
+            return Token::Code::Identifier;
         }
-    }
 
     default:
         break;
     }
 
-    if (isIdentifierStartChar(c))
-    {
-        while (isIdentifierChar(peekChar()))
-            readChar();
-
-        outValue.symbol = getSymbol(StringSpan(textStart, _cursor));
-
-        return Token::Code::Identifier;
-    }
+    if (c == kEndOfFile)
+        return Token::Code::EndOfFile;
 
     error(getLoc(), "unexpected character 'c'", c);
     return Token::Code::InvalidChar;
 }
 
-}
\ No newline at end of file
+}
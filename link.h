@@ -0,0 +1,262 @@
+// link.h
+#pragma once
+
+#include "bytecode.h"
+
+namespace theta
+{
+namespace bytecode
+{
+
+    // A program, linked into the form that the VM runs from.
+    //
+    // The emitter produces a tree of `BCDecl`s, each with its own
+    // chunks, and each chunk with its own vectors of bytes and
+    // constants. That is convenient to build and to cache, but
+    // creating an object from it means chasing pointers all over the
+    // heap. Linking flattens the tree:
+    //
+    // * decls are numbered breadth-first, so that the members of each
+    //   decl are a contiguous range of indices, and a member can be
+    //   found from its parent by adding its position;
+    //
+    // * what the VM needs to know about each decl (its slot count,
+    //   first member, and where its code and constants start) is kept
+    //   in parallel arrays indexed by decl, rather than in the decls;
+    //
+    // * all code is packed into one buffer, and all constants into
+    //   one pool.
+    //
+    // Initializing a part runs the init code of each member of its
+    // decl in order, so rather than pushing a frame per member the
+    // linker concatenates those into one *part init* chunk per decl,
+    // with each member's final `Return` removed. The one thing that
+    // init code takes from its frame, other than `self`, is the decl
+    // whose pattern `CreatePatternFrom*` ops create, so in the fused
+    // chunk those name the member by index instead.
+    //
+    // Instructions that need an inline cache in the VM (currently
+    // just `GetBasePart`) are emitted with a cache index of zero, and
+    // the linker gives each one a cache of its own.
+    //
+    // Linking is a pure function of the `BCDecl`s, so it is redone
+    // whenever a program is loaded rather than stored in images.
+    //
+typedef uint32_t DeclIndex;
+
+struct LinkedProgram
+{
+public:
+    enum : uint32_t
+    {
+            // The part init offset of a decl without members, whose
+            // parts have nothing to initialize
+        kNoCode = ~uint32_t(0),
+    };
+
+    LinkedProgram()
+    {}
+
+    LinkedProgram(LinkedProgram const&) = delete;
+    LinkedProgram& operator=(LinkedProgram const&) = delete;
+
+    void link(BCDecl const* program)
+    {
+        clear();
+
+        _decls.push_back(program);
+        for (DeclIndex declIndex = 0; declIndex < DeclIndex(_decls.size()); declIndex++)
+        {
+            BCDecl const* decl = _decls[declIndex];
+
+            if (_decls.size() + decl->getMembers().size() > kNoCode)
+                error(SourceLoc(), "too many declarations to link");
+
+            _slotCounts.push_back(uint32_t(decl->_slotCount));
+            _firstMembers.push_back(DeclIndex(_decls.size()));
+            for (auto member : decl->getMembers())
+                _decls.push_back(member);
+
+            linkPartInitCode(decl);
+            linkBodyCode(decl);
+        }
+    }
+
+    Count getDeclCount() const { return Count(_decls.size()); }
+
+        // The decl that `declIndex` was linked from (for naming it in
+        // dumps and errors; the VM itself doesn't look at it)
+    BCDecl const* getDecl(DeclIndex declIndex) const { return _decls[declIndex]; }
+
+    Count getSlotCount(DeclIndex declIndex) const { return _slotCounts[declIndex]; }
+
+    DeclIndex getMember(DeclIndex declIndex, Index memberIndex) const
+    {
+        return DeclIndex(_firstMembers[declIndex] + memberIndex);
+    }
+
+    bool hasPartInitCode(DeclIndex declIndex) const
+    {
+        return _partInitCodeOffsets[declIndex] != kNoCode;
+    }
+
+    Byte const* getPartInitCode(DeclIndex declIndex) const { return _code.data() + _partInitCodeOffsets[declIndex]; }
+    Value const* getPartInitConstants(DeclIndex declIndex) const { return _constants.data() + _partInitConstantBases[declIndex]; }
+
+    Byte const* getBodyCode(DeclIndex declIndex) const { return _code.data() + _bodyCodeOffsets[declIndex]; }
+    Value const* getBodyConstants(DeclIndex declIndex) const { return _constants.data() + _bodyConstantBases[declIndex]; }
+
+    Size getCodeSize() const { return _code.size(); }
+
+        // The number of inline caches that the code refers to
+    Count getInlineCacheCount() const { return _inlineCacheCount; }
+
+private:
+    void clear()
+    {
+        _decls.clear();
+        _slotCounts.clear();
+        _firstMembers.clear();
+        _partInitCodeOffsets.clear();
+        _partInitConstantBases.clear();
+        _bodyCodeOffsets.clear();
+        _bodyConstantBases.clear();
+        _code.clear();
+        _constants.clear();
+        _inlineCacheCount = 0;
+    }
+
+    uint32_t getCodeOffset()
+    {
+        if (_code.size() >= kNoCode)
+            error(SourceLoc(), "too much code to link");
+        return uint32_t(_code.size());
+    }
+
+    uint32_t getConstantBase()
+    {
+        if (_constants.size() >= UINT32_MAX)
+            error(SourceLoc(), "too many constants to link");
+        return uint32_t(_constants.size());
+    }
+
+    void linkPartInitCode(BCDecl const* decl)
+    {
+        uint32_t codeOffset = getCodeOffset();
+        uint32_t constantBase = getConstantBase();
+
+        auto const& members = decl->getMembers();
+        for (Index memberIndex = 0; memberIndex < Index(members.size()); memberIndex++)
+        {
+            CodeChunk const& memberCode = members[memberIndex]->initCode;
+            unsigned int memberConstantBase = (unsigned int)(_constants.size() - constantBase);
+            _constants.insert(_constants.end(), memberCode._constants.begin(), memberCode._constants.end());
+
+            Byte const* cursor = memberCode._bytes.data();
+            Byte const* end = cursor + memberCode._bytes.size();
+            for (;;)
+            {
+                Instruction instruction;
+                decodeCheckedInstruction(cursor, end, instruction);
+                if (instruction.opcode == Opcode::Return)
+                {
+                    checkChunkEnd(cursor, end);
+                    break;
+                }
+
+                switch (instruction.opcode)
+                {
+                case Opcode::CreatePatternFromMainPart:
+                    instruction.opcode = Opcode::CreateMemberPattern;
+                    instruction.operands[0] = (unsigned int) memberIndex;
+                    break;
+
+                case Opcode::CreatePatternFromBaseAndMainPart:
+                    instruction.opcode = Opcode::CreateMemberPatternFromBase;
+                    instruction.operands[0] = (unsigned int) memberIndex;
+                    break;
+
+                case Opcode::Constant:
+                    instruction.operands[0] += memberConstantBase;
+                    break;
+
+                default:
+                    break;
+                }
+                linkInstruction(instruction);
+            }
+        }
+
+        if (_code.size() == codeOffset)
+        {
+            _partInitCodeOffsets.push_back(kNoCode);
+            _partInitConstantBases.push_back(constantBase);
+            return;
+        }
+
+        _code.push_back(Byte(Opcode::Return));
+        _partInitCodeOffsets.push_back(codeOffset);
+        _partInitConstantBases.push_back(constantBase);
+    }
+
+    void linkBodyCode(BCDecl const* decl)
+    {
+        CodeChunk const& bodyCode = decl->bodyCode;
+
+        _bodyCodeOffsets.push_back(getCodeOffset());
+        _bodyConstantBases.push_back(getConstantBase());
+
+        _constants.insert(_constants.end(), bodyCode._constants.begin(), bodyCode._constants.end());
+
+        Byte const* cursor = bodyCode._bytes.data();
+        Byte const* end = cursor + bodyCode._bytes.size();
+        for (;;)
+        {
+            Instruction instruction;
+            decodeCheckedInstruction(cursor, end, instruction);
+            linkInstruction(instruction);
+            if (instruction.opcode == Opcode::Return)
+            {
+                checkChunkEnd(cursor, end);
+                break;
+            }
+        }
+    }
+
+        // Code is laid out back to back, so a chunk must end with its
+        // `Return`: without one it would run on into the next chunk.
+        // (Decoding already fails if the chunk has no `Return` at all.)
+    static void checkChunkEnd(Byte const* cursor, Byte const* end)
+    {
+        if (cursor != end)
+            error(SourceLoc(), "invalid bytecode (code after return)");
+    }
+
+        // Append `instruction` to the code, giving it an inline
+        // cache if it needs one
+    void linkInstruction(Instruction& instruction)
+    {
+        if (instruction.opcode == Opcode::GetBasePart)
+            instruction.operands[1] = (unsigned int) _inlineCacheCount++;
+
+        encodeInstruction(_code, instruction);
+    }
+
+        // Per-decl tables, indexed by `DeclIndex`
+    std::vector<BCDecl const*> _decls;
+    std::vector<uint32_t> _slotCounts;
+    std::vector<DeclIndex> _firstMembers;
+    std::vector<uint32_t> _partInitCodeOffsets;
+    std::vector<uint32_t> _partInitConstantBases;
+    std::vector<uint32_t> _bodyCodeOffsets;
+    std::vector<uint32_t> _bodyConstantBases;
+
+        // The code and constants of every decl
+    std::vector<Byte> _code;
+    std::vector<Value> _constants;
+
+    Count _inlineCacheCount = 0;
+};
+
+}
+}
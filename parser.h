@@ -1,6 +1,8 @@
 // parser.h
 #pragma once
 
+#include "token-buffer.h"
+
 namespace theta
 {
 using namespace ast;
@@ -15,12 +17,21 @@ struct NameToken : Token
 
 struct Parser
 {
+        // Parse tokens read one at a time from `lexer`
     void init(Lexer* lexer)
     {
         _lexer = lexer;
         _nextToken = _lexer->readToken();
     }
 
+        // Parse tokens from a buffer that has been (or is being)
+        // filled ahead of time, which allows more lookahead.
+    void init(TokenBuffer* tokens)
+    {
+        _tokens = tokens;
+        _tokenIndex = 0;
+    }
+
     SourceLoc getLoc()
     {
         return SourceLoc();
@@ -28,16 +39,28 @@ struct Parser
 
     Token::Code peekTokenCode()
     {
+        if (_tokens)
+            return _tokens->getCode(_tokenIndex);
         return _nextToken.code;
     }
 
     Token peekToken()
     {
+        if (_tokens)
+            return _tokens->getToken(_tokenIndex);
         return _nextToken;
     }
 
     Token readToken()
     {
+        if (_tokens)
+        {
+            auto token = _tokens->getToken(_tokenIndex);
+            if (token.code != Token::Code::EndOfFile)
+                _tokenIndex++;
+            return token;
+        }
+
         auto token = _nextToken;
         _nextToken = _lexer->readToken();
         return token;
@@ -500,9 +523,12 @@ struct Parser
         return decl;
     }
 
-    Lexer* _lexer;
+    Lexer* _lexer = nullptr;
     Token _nextToken;
 
+    TokenBuffer* _tokens = nullptr;
+    Index _tokenIndex = 0;
+
     bool _isRecovering = false;
 };
 
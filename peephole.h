@@ -0,0 +1,248 @@
+// peephole.h
+#pragma once
+
+#include "bytecode.h"
+
+namespace theta
+{
+namespace bytecode
+{
+
+    // A peephole optimizer for the code of a `BCDecl`.
+    //
+    // There are no branches in the instruction set, so a chunk can be
+    // decoded into a list of instructions, rewritten by local rules
+    // until none of them apply, and encoded again, without any jump
+    // targets to fix up. The rules are:
+    //
+    // * `Nop`s are dropped, as is anything after a `Return`;
+    //
+    // * a value that is pushed without side effects and then popped
+    //   is never pushed, and an op that only replaces the value on
+    //   top of the stack is dropped if that value is then popped;
+    //
+    // * walks out through origins (`GetMixinFromPart` followed by
+    //   `GetOriginPartFromMixin`, any number of times) become a single
+    //   counted `GetOuterPartOf`, or `GetOuterPart` when they start
+    //   from `self`, and a `GetPartSlot` of the result becomes a
+    //   `GetSelfSlot` or `GetOuterSlot`.
+    //
+    // Constants that are no longer referenced are then dropped from
+    // the chunk's pool.
+    //
+struct PeepholeOptimizer
+{
+    void optimizeDecl(BCDecl* decl)
+    {
+        optimizeChunk(decl->initCode);
+        optimizeChunk(decl->bodyCode);
+    }
+
+    void optimizeChunk(CodeChunk& chunk)
+    {
+        _code.clear();
+
+        Byte const* cursor = chunk._bytes.data();
+        Byte const* end = cursor + chunk._bytes.size();
+        while (cursor != end)
+        {
+            Instruction instruction;
+            decodeInstruction(cursor, instruction);
+
+            append(instruction);
+            if (instruction.opcode == Opcode::Return)
+                break;
+        }
+
+        removeUnusedConstants(chunk);
+
+        chunk._bytes.clear();
+        for (auto const& instruction : _code)
+            encodeInstruction(chunk._bytes, instruction);
+    }
+
+private:
+    void append(Instruction const& instruction)
+    {
+        _code.push_back(instruction);
+        while (rewriteLast())
+        {}
+    }
+
+        // Try to apply a rule at the end of the code so far, and
+        // return whether anything changed
+    bool rewriteLast()
+    {
+        if (_code.empty())
+            return false;
+
+        Instruction& last = _code.back();
+        switch (last.opcode)
+        {
+        case Opcode::Nop:
+            _code.pop_back();
+            return true;
+
+        case Opcode::Pop:
+            if (Instruction* previous = getPrevious())
+            {
+                if (isPurePush(previous->opcode))
+                {
+                    _code.pop_back();
+                    _code.pop_back();
+                    return true;
+                }
+                if (isPureReplace(previous->opcode))
+                {
+                    *previous = last;
+                    _code.pop_back();
+                    return true;
+                }
+            }
+            return false;
+
+        case Opcode::GetOriginPartFromMixin:
+            if (Instruction* previous = getPrevious())
+            {
+                if (previous->opcode == Opcode::GetMixinFromPart)
+                {
+                    _code.pop_back();
+                    setInstruction(_code.back(), Opcode::GetOuterPartOf, 1);
+                    return true;
+                }
+            }
+            return false;
+
+        case Opcode::GetOuterPartOf:
+            if (Instruction* previous = getPrevious())
+            {
+                unsigned int levelCount = last.operands[0];
+                switch (previous->opcode)
+                {
+                case Opcode::GetOuterPartOf:
+                case Opcode::GetOuterPart:
+                    levelCount += previous->operands[0];
+                    _code.pop_back();
+                    _code.back().operands[0] = levelCount;
+                    return true;
+
+                case Opcode::GetSelfPart:
+                    _code.pop_back();
+                    setInstruction(_code.back(), Opcode::GetOuterPart, levelCount);
+                    return true;
+
+                default:
+                    break;
+                }
+            }
+            return false;
+
+        case Opcode::GetPartSlot:
+            if (Instruction* previous = getPrevious())
+            {
+                unsigned int slotIndex = last.operands[0];
+                switch (previous->opcode)
+                {
+                case Opcode::GetSelfPart:
+                    _code.pop_back();
+                    setInstruction(_code.back(), Opcode::GetSelfSlot, slotIndex);
+                    return true;
+
+                case Opcode::GetOuterPart:
+                    {
+                        unsigned int levelCount = previous->operands[0];
+                        _code.pop_back();
+                        setInstruction(_code.back(), Opcode::GetOuterSlot, levelCount, slotIndex);
+                    }
+                    return true;
+
+                default:
+                    break;
+                }
+            }
+            return false;
+
+        default:
+            return false;
+        }
+    }
+
+    Instruction* getPrevious()
+    {
+        if (_code.size() < 2)
+            return nullptr;
+        return &_code[_code.size() - 2];
+    }
+
+    static void setInstruction(Instruction& instruction, Opcode opcode, unsigned int operand0 = 0, unsigned int operand1 = 0)
+    {
+        instruction.opcode = opcode;
+        instruction.operands[0] = operand0;
+        instruction.operands[1] = operand1;
+    }
+
+        // Ops that push a value, with no other effect
+    static bool isPurePush(Opcode opcode)
+    {
+        switch (opcode)
+        {
+        case Opcode::Constant:
+        case Opcode::GetSelfPart:
+        case Opcode::GetSelfSlot:
+        case Opcode::GetOuterSlot:
+        case Opcode::GetOuterPart:
+        case Opcode::GetEmptyPattern:
+            return true;
+
+        default:
+            return false;
+        }
+    }
+
+        // Ops that pop one value and push another, with no other effect
+    static bool isPureReplace(Opcode opcode)
+    {
+        switch (opcode)
+        {
+        case Opcode::GetPartSlot:
+        case Opcode::GetOuterPartOf:
+        case Opcode::GetMixinFromPart:
+        case Opcode::GetOriginPartFromMixin:
+            return true;
+
+        default:
+            return false;
+        }
+    }
+
+    void removeUnusedConstants(CodeChunk& chunk)
+    {
+        if (chunk._constants.empty())
+            return;
+
+        static const unsigned int kUnused = ~0u;
+        std::vector<unsigned int> newIndices(chunk._constants.size(), kUnused);
+        std::vector<Value> constants;
+
+        for (auto& instruction : _code)
+        {
+            if (instruction.opcode != Opcode::Constant)
+                continue;
+
+            unsigned int& newIndex = newIndices[instruction.operands[0]];
+            if (newIndex == kUnused)
+            {
+                newIndex = (unsigned int) constants.size();
+                constants.push_back(chunk._constants[instruction.operands[0]]);
+            }
+            instruction.operands[0] = newIndex;
+        }
+
+        chunk._constants.swap(constants);
+    }
+
+    std::vector<Instruction> _code;
+};
+
+}
+}
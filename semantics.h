@@ -1,6 +1,10 @@
 // semantics.h
 #pragma once
 
+#include "compile-cache.h"
+#include "syntax.h"
+#include "task-pool.h"
+
 namespace theta
 {
 namespace semantics
@@ -11,7 +15,30 @@ using namespace ast;
 class Checker
 {
 public:
-    SelfExpr* _self;
+    Checker()
+    {}
+
+        // Check sibling declarations in parallel on `pool`, with
+        // nodes allocated from the matching per-worker `arenas`, and
+        // skip the bodies of declarations that `cache` already has
+        // bytecode for.
+    Checker(TaskPool* pool, WorkerNodeArenas* arenas, CompilationCache* cache = nullptr)
+        : _pool(pool)
+        , _workerArenas(arenas)
+        , _cache(cache)
+    {}
+
+    Checker(Checker const&) = delete;
+    Checker& operator=(Checker const&) = delete;
+
+    SelfExpr* _self = nullptr;
+
+    TaskPool* _pool = nullptr;
+    WorkerNodeArenas* _workerArenas = nullptr;
+    CompilationCache* _cache = nullptr;
+
+        // The checker that owns state shared by the whole program
+    Checker* _root = this;
 
     Classifier::Kind getClassifierKind(Decl* decl)
     {
@@ -310,11 +337,19 @@ public:
         return classifier.pattern;
     }
 
+        // Shared by every checker working on the program (via `_root`),
+        // and created by whichever of them needs it first.
     EmptyStaticPattern* emptyPattern = nullptr;
+    std::once_flag _emptyPatternOnce;
+
     EmptyStaticPattern* getEmptyPattern()
     {
-        if (!emptyPattern) emptyPattern = new EmptyStaticPattern();
-        return emptyPattern;
+        Checker* root = _root;
+        std::call_once(root->_emptyPatternOnce, [root]()
+        {
+            root->emptyPattern = new EmptyStaticPattern();
+        });
+        return root->emptyPattern;
     }
 
     StaticPattern* createStaticPattern(Expr* origin, SimpleDecl* decl)
@@ -341,7 +376,8 @@ public:
             else
             {
                 // Can't handle this case
-                throw 99;
+                error(decl->getLoc(), "unhandled case for pattern merge");
+                return getEmptyPattern();
             }
         }
         else
@@ -368,7 +404,7 @@ public:
             else
             {
                 // Can't handle this case
-                throw 99;
+                error(decl->getLoc(), "unhandled case for pattern merge");
             }
 
             staticPattern->_mixins.push_back(staticPattern);
@@ -439,10 +475,22 @@ public:
 #endif
 
     void checkDecl(Decl* decl)
+    {
+        checkDeclSignature(decl);
+        checkDeclBody(decl);
+    }
+
+        // Check the parts of `decl` that other declarations can see:
+        // its bases, and the slots and bases of its members.
+        //
+        // This is done in order, since the bases of a declaration can
+        // refer to siblings declared before it.
+        //
+    void checkDeclSignature(Decl* decl)
     {
         if (auto simpleDecl = as<SimpleDecl>(decl))
         {
-            checkSimpleDecl(simpleDecl);
+            checkSimpleDeclSignature(simpleDecl);
         }
         else
         {
@@ -450,7 +498,7 @@ public:
         }
     }
 
-    void checkSimpleDecl(SimpleDecl* decl)
+    void checkSimpleDeclSignature(SimpleDecl* decl)
     {
         // TODO: check for name conflict
 
@@ -511,20 +559,76 @@ public:
 
             for( auto memberDecl : mainPart->_decls )
             {
-                checkDecl(memberDecl);
+                checkDeclSignature(memberDecl);
             }
 
-            checkStmt(mainPart->_stmt);
-
             popScope();
         }
     }
 
+        // Check the statements in `decl` and its members.
+        //
+        // Once every signature has been checked, the bodies of sibling
+        // members only read shared state (and write to their own
+        // subtree), so they are checked in parallel when we have a
+        // task pool. Each one gets a checker of its own, and with it
+        // a `_self` chain of its own.
+        //
+    void checkDeclBody(Decl* decl)
+    {
+        auto simpleDecl = as<SimpleDecl>(decl);
+        if (!simpleDecl)
+            return;
+
+        auto mainPart = simpleDecl->_mainPart;
+        if (!mainPart)
+            return;
+
+        // Nothing in the body of an unchanged declaration needs to
+        // be checked, since its bytecode will be reused as-is.
+        //
+        if (_cache && _cache->findDecl(decl))
+            return;
+
+        pushScope(simpleDecl);
+
+        auto& members = mainPart->_decls;
+        parallelFor(_pool, Count(members.size()), [&](Index i)
+        {
+            Checker memberChecker(this);
+            WithNodeArena withNodeArena(memberChecker.getWorkerNodeArena());
+
+            memberChecker.checkDeclBody(members[i]);
+        });
+
+        checkStmt(mainPart->_stmt);
+
+        popScope();
+    }
+
     void checkProgram(Decl* program)
     {
         checkDecl(program);
     }
 
+private:
+        // A checker for one member of the declaration that `parent`
+        // is currently checking.
+    explicit Checker(Checker* parent)
+        : _self(parent->_self)
+        , _pool(parent->_pool)
+        , _workerArenas(parent->_workerArenas)
+        , _cache(parent->_cache)
+        , _root(parent->_root)
+    {}
+
+    MemoryArena* getWorkerNodeArena()
+    {
+        if (!_workerArenas)
+            return gNodeArena;
+        return _workerArenas->getArena(TaskPool::getCurrentWorkerIndex());
+    }
+
 };
 
 }
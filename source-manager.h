@@ -17,34 +17,204 @@ struct SourceRange
 
 struct SourceFile
 {
+    enum class Storage
+    {
+        // `_text` points into a heap buffer that we read the file into
+        Heap,
+
+        // `_text` points directly into a read-only mapping of the file
+        Mapped,
+    };
+
     char const* _path;
     StringSpan _text;
+
+    Storage _storage = Storage::Heap;
+
+#ifdef _WIN32
+    HANDLE _fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE _mappingHandle = nullptr;
+#endif
 };
 
-SourceFile* loadSourceFile(char const* path)
+enum
+{
+        // Files at least this large get a hint that they will be
+        // read sequentially, so the OS can read ahead aggressively.
+    kSequentialAccessHintSize = 1024 * 1024,
+
+        // Files that are read rather than mapped are read into a
+        // buffer that starts at this size and doubles as needed.
+    kInitialReadBufferSize = 64 * 1024,
+};
+
+    // Read the whole of `path` into a heap buffer.
+    //
+    // This is the fallback when a file can't be mapped, which includes
+    // pipes and devices, so it reads until the end of the input rather
+    // than asking the file for its size.
+    //
+SourceFile* readSourceFile(char const* path)
 {
     FILE* f = fopen(path, "rb");
     if(!f) return nullptr;
 
-    fseek(f, 0, SEEK_END);
-    size_t size = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    size_t size = 0;
+    size_t capacity = kInitialReadBufferSize;
+    char* buffer = (char*) malloc(capacity + 1);
+    while (buffer)
+    {
+        size += fread(buffer + size, 1, capacity - size, f);
+        if (size < capacity)
+            break;
 
-    char* buffer = (char*) malloc(size + 1);
+        capacity *= 2;
+        char* newBuffer = (char*) realloc(buffer, capacity + 1);
+        if (!newBuffer)
+            free(buffer);
+        buffer = newBuffer;
+    }
 
-    if( fread(buffer, size, 1, f) != 1 )
+    if( !buffer || ferror(f) )
     {
         free(buffer);
+        fclose(f);
         return nullptr;
     }
     buffer[size] = 0;
+    fclose(f);
 
     SourceFile* sourceFile = new SourceFile();
     sourceFile->_path = path;
     sourceFile->_text = StringSpan(buffer, buffer+size);
+    sourceFile->_storage = SourceFile::Storage::Heap;
+
+    return sourceFile;
+}
+
+    // Map `path` into memory, so that tokens can refer directly
+    // into the file contents without making a copy.
+    //
+    // Note that the mapped text is *not* null-terminated; the lexer
+    // only relies on the end of the `StringSpan`.
+    //
+SourceFile* mapSourceFile(char const* path)
+{
+#ifdef _WIN32
+    // The size decides whether to ask for sequential access, and the
+    // flag has to be passed when the file is opened.
+    //
+    DWORD flags = FILE_ATTRIBUTE_NORMAL;
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (GetFileAttributesExA(path, GetFileExInfoStandard, &attributes))
+    {
+        uint64_t attributeSize = (uint64_t(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+        if (attributeSize >= kSequentialAccessHintSize)
+            flags = FILE_FLAG_SEQUENTIAL_SCAN;
+    }
+
+    HANDLE fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(fileHandle);
+        return nullptr;
+    }
+    size_t size = size_t(fileSize.QuadPart);
+
+    HANDLE mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mappingHandle)
+    {
+        CloseHandle(fileHandle);
+        return nullptr;
+    }
+
+    void* data = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    if (!data)
+    {
+        CloseHandle(mappingHandle);
+        CloseHandle(fileHandle);
+        return nullptr;
+    }
+
+    SourceFile* sourceFile = new SourceFile();
+    sourceFile->_fileHandle = fileHandle;
+    sourceFile->_mappingHandle = mappingHandle;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode) || fileStat.st_size == 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = size_t(fileStat.st_size);
+
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // The mapping keeps the file contents alive on its own
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    if (size >= kSequentialAccessHintSize)
+    {
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+
+    SourceFile* sourceFile = new SourceFile();
+#endif
+
+    char const* text = (char const*) data;
+
+    sourceFile->_path = path;
+    sourceFile->_text = StringSpan(text, text + size);
+    sourceFile->_storage = SourceFile::Storage::Mapped;
 
     return sourceFile;
+}
+
+SourceFile* loadSourceFile(char const* path)
+{
+    if (auto sourceFile = mapSourceFile(path))
+        return sourceFile;
+
+    // Things like empty files, pipes, and devices can't be
+    // mapped, so we fall back to reading them in.
+    //
+    return readSourceFile(path);
+}
+
+void unloadSourceFile(SourceFile* sourceFile)
+{
+    if (!sourceFile)
+        return;
+
+    switch (sourceFile->_storage)
+    {
+    case SourceFile::Storage::Heap:
+        free((void*) sourceFile->_text._begin);
+        break;
+
+    case SourceFile::Storage::Mapped:
+#ifdef _WIN32
+        UnmapViewOfFile(sourceFile->_text._begin);
+        CloseHandle(sourceFile->_mappingHandle);
+        CloseHandle(sourceFile->_fileHandle);
+#else
+        munmap((void*) sourceFile->_text._begin, sourceFile->_text.getSize());
+#endif
+        break;
+    }
 
+    delete sourceFile;
 }
 
 }
@@ -1,6 +1,7 @@
 // syntax.h
 #pragma once
 
+#include "arena.h"
 #include "token.h"
 
 namespace theta
@@ -16,6 +17,113 @@ class PatternDeclBase;
 class Syntax;
 class Expr;
 
+    // All of the `Node`s for a single compilation are allocated
+    // out of one `MemoryArena`, and are released together when
+    // that arena is. Code that creates nodes establishes the arena
+    // to use with a `WithNodeArena` scope.
+    //
+    // The current arena is per-thread, so that work running on a
+    // `TaskPool` can allocate from its own worker's arena (see
+    // `WorkerNodeArenas`) without locking.
+    //
+thread_local MemoryArena* gNodeArena = nullptr;
+
+struct WithNodeArena
+{
+    WithNodeArena(MemoryArena* arena)
+        : _saved(gNodeArena)
+    {
+        gNodeArena = arena;
+    }
+
+    ~WithNodeArena()
+    {
+        gNodeArena = _saved;
+    }
+
+    MemoryArena* _saved;
+};
+
+    // One node arena per worker of a `TaskPool`.
+    //
+    // These should live as long as the compilation's main node
+    // arena, since nodes created by tasks end up linked into the
+    // same AST.
+    //
+struct WorkerNodeArenas
+{
+    explicit WorkerNodeArenas(Count workerCount)
+        : _arenas(new MemoryArena[workerCount])
+        , _count(workerCount)
+    {}
+
+    ~WorkerNodeArenas()
+    {
+        delete[] _arenas;
+    }
+
+    WorkerNodeArenas(WorkerNodeArenas const&) = delete;
+    WorkerNodeArenas& operator=(WorkerNodeArenas const&) = delete;
+
+    MemoryArena* getArena(Index workerIndex)
+    {
+        assert(workerIndex >= 0 && workerIndex < _count);
+        return &_arenas[workerIndex];
+    }
+
+    MemoryArena* _arenas;
+    Count _count;
+};
+
+    // Allocator for the lists stored in `Node`s, so that their
+    // storage comes from the same arena as the nodes themselves.
+    //
+template<typename T>
+struct NodeAllocator
+{
+    typedef T value_type;
+
+    NodeAllocator()
+        : _arena(gNodeArena)
+    {}
+
+    template<typename U>
+    NodeAllocator(NodeAllocator<U> const& other)
+        : _arena(other._arena)
+    {}
+
+    T* allocate(size_t count)
+    {
+        if (_arena)
+            return _arena->allocateArray<T>(count);
+        return (T*) ::operator new(count * sizeof(T));
+    }
+
+    void deallocate(T* ptr, size_t)
+    {
+        // Arena storage is released all at once
+        if (!_arena)
+            ::operator delete(ptr);
+    }
+
+    MemoryArena* _arena;
+};
+
+template<typename T, typename U>
+bool operator==(NodeAllocator<T> const& left, NodeAllocator<U> const& right)
+{
+    return left._arena == right._arena;
+}
+
+template<typename T, typename U>
+bool operator!=(NodeAllocator<T> const& left, NodeAllocator<U> const& right)
+{
+    return left._arena != right._arena;
+}
+
+template<typename T>
+using NodeList = std::vector<T, NodeAllocator<T>>;
+
 struct SourceRangeInfo
 {
     SourceRangeInfo()
@@ -34,48 +142,89 @@ struct SourceRangeInfo
 class Node
 {
 public:
+    // The tags are ordered so that the tags for all the concrete
+    // subclasses of any given class form a contiguous range. Each
+    // class records its range as `kFirstTag`/`kLastTag`, and `as<T>()`
+    // is then just a range check on the tag.
+    //
+    // Any new tag must be added inside the range(s) of its base class(es).
+    //
     enum class Tag
     {
-        PatternDecl,
-        VirtualPatternDecl,
-        FurtherPatternDecl,
+        // Syntax
+        //   Stmt
+        //     Decl
 
-        ObjectDecl,
+        SyntaxDecl,
 
+        //       ValueDeclBase
         VarDecl,
         LetDecl,
         ParamDecl,
 
-        SyntaxDecl,
+        //       PatternDeclBase
+        PatternDecl,
+        VirtualPatternDecl,
+        FurtherPatternDecl,
+        ObjectDecl,
 
+        //     Expr
         NameExpr,
         MemberExpr,
 
-        SeqStmt,
-
+        //       TypedExpr
         SelfPath,
         SlotPath,
         OriginPath,
-
         CastToBaseExpr,
 
+        //     Other statements
+        SeqStmt,
+
+        //   Other syntax
         MainPart,
 
+        //   Modifier
+        BuiltinModifier,
+
+        // StaticPattern
         EmptyStaticPattern,
         StaticMixin,
 
+        // MixinPath
         EmptyMixinPath,
         BaseMixinPath,
-
-        BuiltinModifier,
     };
 
+    static const Tag kFirstTag = Tag::SyntaxDecl;
+    static const Tag kLastTag = Tag::BaseMixinPath;
+
     Node(Tag tag)
         : _tag(tag)
     {}
 
     virtual ~Node() {}
 
+        // Nodes can only be created inside a `WithNodeArena` scope.
+        //
+        // The size of a type is a multiple of its alignment, so the
+        // lowest set bit of `size` is enough alignment for the node
+        // being created (and is usually just that of a pointer).
+        //
+    static void* operator new(size_t size)
+    {
+        assert(gNodeArena);
+        size_t alignment = size & (~size + 1);
+        if (alignment > alignof(max_align_t))
+            alignment = alignof(max_align_t);
+        return gNodeArena->allocate(size, alignment);
+    }
+
+        // Nodes are never freed one at a time; they are released
+        // along with the arena they were allocated from.
+    static void operator delete(void*)
+    {}
+
     Tag getTag() { return _tag; }
 
 private:
@@ -87,6 +236,9 @@ class Syntax : public Node
 public:
     typedef Node Super;
 
+    static const Tag kFirstTag = Tag::SyntaxDecl;
+    static const Tag kLastTag = Tag::BuiltinModifier;
+
     Syntax(Tag tag)
         : Super(tag)
     {}
@@ -114,12 +266,15 @@ class StaticPattern : public Node
 public:
     typedef Node Super;
 
+    static const Tag kFirstTag = Tag::EmptyStaticPattern;
+    static const Tag kLastTag = Tag::StaticMixin;
+
     StaticPattern(Tag tag)
         : Super(tag)
     {}
 
     // Flattened list of all mixins, in precedence order
-    std::vector<StaticMixin*> _mixins;
+    NodeList<StaticMixin*> _mixins;
 };
 
 // A path from a view part to another of its statically-known mixins
@@ -128,6 +283,9 @@ class MixinPath : public Node
 public:
     typedef Node Super;
 
+    static const Tag kFirstTag = Tag::EmptyMixinPath;
+    static const Tag kLastTag = Tag::BaseMixinPath;
+
     MixinPath(Tag tag)
         : Super(tag)
     {}
@@ -138,6 +296,9 @@ class EmptyMixinPath : public MixinPath
 public:
     typedef MixinPath Super;
 
+    static const Tag kFirstTag = Tag::EmptyMixinPath;
+    static const Tag kLastTag = Tag::EmptyMixinPath;
+
     EmptyMixinPath()
         : Super(Tag::EmptyMixinPath)
     {}
@@ -148,6 +309,9 @@ class BaseMixinPath : public MixinPath
 public:
     typedef MixinPath Super;
 
+    static const Tag kFirstTag = Tag::BaseMixinPath;
+    static const Tag kLastTag = Tag::BaseMixinPath;
+
     BaseMixinPath(int baseIndex, MixinPath* rest)
         : Super(Tag::BaseMixinPath)
         , _baseIndex(baseIndex)
@@ -164,6 +328,9 @@ class StaticMixin : public StaticPattern
 public:
     typedef StaticPattern Super;
 
+    static const Tag kFirstTag = Tag::StaticMixin;
+    static const Tag kLastTag = Tag::StaticMixin;
+
     StaticMixin(PatternDeclBase* decl, Expr* origin, MixinPath* relativePath)
         : Super(Tag::StaticMixin)
         , _decl(decl)
@@ -174,7 +341,7 @@ public:
     PatternDeclBase* getDecl();
 
     // Declared bases
-    std::vector<StaticPattern*> _bases;
+    NodeList<StaticPattern*> _bases;
 
     PatternDeclBase* _decl;
     Expr* _origin;
@@ -187,6 +354,9 @@ class EmptyStaticPattern : public StaticPattern
 public:
     typedef StaticPattern Super;
 
+    static const Tag kFirstTag = Tag::EmptyStaticPattern;
+    static const Tag kLastTag = Tag::EmptyStaticPattern;
+
     EmptyStaticPattern()
         : Super(Tag::EmptyStaticPattern)
     {}
@@ -211,6 +381,9 @@ class Modifier : public Syntax
 public:
     typedef Syntax Super;
 
+    static const Tag kFirstTag = Tag::BuiltinModifier;
+    static const Tag kLastTag = Tag::BuiltinModifier;
+
     Modifier(Tag tag, SourceRangeInfo const& info)
         : Super(tag, info)
     {}
@@ -223,6 +396,9 @@ class Stmt : public Syntax
 public:
     typedef Syntax Super;
 
+    static const Tag kFirstTag = Tag::SyntaxDecl;
+    static const Tag kLastTag = Tag::SeqStmt;
+
     Stmt(Tag tag)
         : Super(tag)
     {}
@@ -237,11 +413,14 @@ class SeqStmt : public Stmt
 public:
     typedef Stmt Super;
 
+    static const Tag kFirstTag = Tag::SeqStmt;
+    static const Tag kLastTag = Tag::SeqStmt;
+
     SeqStmt(SourceRangeInfo const& info)
         : Super(Tag::SeqStmt, info)
     {}
 
-    std::vector<Stmt*> stmts;
+    NodeList<Stmt*> stmts;
 };
 
 class Decl : public Stmt
@@ -249,6 +428,9 @@ class Decl : public Stmt
 public:
     typedef Stmt Super;
 
+    static const Tag kFirstTag = Tag::SyntaxDecl;
+    static const Tag kLastTag = Tag::ObjectDecl;
+
     Decl(Tag tag)
         : Super(tag)
     {}
@@ -260,6 +442,12 @@ public:
 
     Symbol* _name = nullptr;
     size_t _slotIndex = size_t(-1);
+
+    // The key of this decl in a `CompilationCache` (or zero if it
+    // doesn't have one), and the length of its content, which a
+    // cached decl must also match
+    uint64_t _cacheKey = 0;
+    uint64_t _cacheLength = 0;
 };
 
 class SyntaxDecl : public Decl
@@ -267,6 +455,9 @@ class SyntaxDecl : public Decl
 public:
     typedef Decl Super;
 
+    static const Tag kFirstTag = Tag::SyntaxDecl;
+    static const Tag kLastTag = Tag::SyntaxDecl;
+
     typedef Node* (*Callback)(Parser* parser, void* userData);
 
     SyntaxDecl(Symbol* name, Callback callback, void* userData)
@@ -284,6 +475,9 @@ class ValueDeclBase : public Decl
 public:
     typedef Decl Super;
 
+    static const Tag kFirstTag = Tag::VarDecl;
+    static const Tag kLastTag = Tag::ParamDecl;
+
     ValueDeclBase(Tag tag, SourceRangeInfo const& info, Symbol* name, Expr* typeExpr)
         : Super(tag, info, name)
         , _typeExpr(typeExpr)
@@ -297,6 +491,9 @@ class VarDeclBase : public ValueDeclBase
 public:
     typedef ValueDeclBase Super;
 
+    static const Tag kFirstTag = Tag::VarDecl;
+    static const Tag kLastTag = Tag::ParamDecl;
+
     VarDeclBase(Tag tag, SourceRangeInfo const& info, Symbol* name, Expr* typeExpr)
         : Super(tag, info, name, typeExpr)
     {}
@@ -307,6 +504,9 @@ class VarDecl : public VarDeclBase
 public:
     typedef VarDeclBase Super;
 
+    static const Tag kFirstTag = Tag::VarDecl;
+    static const Tag kLastTag = Tag::VarDecl;
+
     VarDecl(SourceRangeInfo const& info, Symbol* name, Expr* typeExpr)
         : Super(Tag::VarDecl, info, name, typeExpr)
     {}
@@ -317,6 +517,9 @@ class LetDeclBase : public VarDeclBase
 public:
     typedef VarDeclBase Super;
 
+    static const Tag kFirstTag = Tag::LetDecl;
+    static const Tag kLastTag = Tag::ParamDecl;
+
     LetDeclBase(Tag tag, SourceRangeInfo const& info, Symbol* name, Expr* typeExpr)
         : Super(tag, info, name, typeExpr)
     {}
@@ -327,6 +530,9 @@ class LetDecl : public LetDeclBase
 public:
     typedef LetDeclBase Super;
 
+    static const Tag kFirstTag = Tag::LetDecl;
+    static const Tag kLastTag = Tag::LetDecl;
+
     LetDecl(SourceRangeInfo const& info, Symbol* name, Expr* typeExpr)
         : Super(Tag::LetDecl, info, name, typeExpr)
     {}
@@ -337,6 +543,9 @@ class ParamDecl : public LetDeclBase
 public:
     typedef LetDeclBase Super;
 
+    static const Tag kFirstTag = Tag::ParamDecl;
+    static const Tag kLastTag = Tag::ParamDecl;
+
     ParamDecl(SourceRangeInfo const& info, Symbol* name, Expr* typeExpr)
         : Super(Tag::ParamDecl, info, name, typeExpr)
     {}
@@ -347,6 +556,9 @@ class PatternDeclBase : public Decl
 public:
     typedef Decl Super;
 
+    static const Tag kFirstTag = Tag::PatternDecl;
+    static const Tag kLastTag = Tag::ObjectDecl;
+
     PatternDeclBase(Tag tag)
         : Super(tag)
     {}
@@ -355,9 +567,9 @@ public:
         : Super(tag, info, name)
     {}
 
-    std::vector<Expr*> _bases;
+    NodeList<Expr*> _bases;
 
-    std::vector<Decl*> _members;
+    NodeList<Decl*> _members;
     size_t _slotCount = 0;
 
     Stmt* _bodyStmt = nullptr;
@@ -368,6 +580,9 @@ class PatternDecl : public PatternDeclBase
 public:
     typedef PatternDeclBase Super;
 
+    static const Tag kFirstTag = Tag::PatternDecl;
+    static const Tag kLastTag = Tag::PatternDecl;
+
     PatternDecl()
         : Super(Tag::PatternDecl)
     {}
@@ -382,6 +597,9 @@ class ObjectDecl : public PatternDeclBase
 public:
     typedef PatternDeclBase Super;
 
+    static const Tag kFirstTag = Tag::ObjectDecl;
+    static const Tag kLastTag = Tag::ObjectDecl;
+
     ObjectDecl()
         : Super(Tag::ObjectDecl)
     {}
@@ -396,6 +614,9 @@ class Expr : public Stmt
 public:
     typedef Stmt Super;
 
+    static const Tag kFirstTag = Tag::NameExpr;
+    static const Tag kLastTag = Tag::CastToBaseExpr;
+
     Expr(Tag tag, SourceRangeInfo const& info)
         : Super(tag, info)
     {}
@@ -414,6 +635,9 @@ class NameExpr : public Expr
 public:
     typedef Expr Super;
 
+    static const Tag kFirstTag = Tag::NameExpr;
+    static const Tag kLastTag = Tag::NameExpr;
+
     NameExpr(SourceRangeInfo const& info, Symbol* name)
         : Super(Tag::NameExpr, info)
         , _name(name)
@@ -427,6 +651,9 @@ class MemberExpr : public Expr
 public:
     typedef Expr Super;
 
+    static const Tag kFirstTag = Tag::MemberExpr;
+    static const Tag kLastTag = Tag::MemberExpr;
+
     MemberExpr(SourceRangeInfo const& info, Expr* base, Symbol* name)
         : Super(Tag::MemberExpr, info)
         , _base(base)
@@ -443,6 +670,9 @@ class TypedExpr : public Expr
 public:
     typedef Expr Super;
 
+    static const Tag kFirstTag = Tag::SelfPath;
+    static const Tag kLastTag = Tag::CastToBaseExpr;
+
     TypedExpr(Tag tag, SourceRangeInfo const& info, Classifier classifier)
         : Super(tag, info)
     {
@@ -456,6 +686,9 @@ class SelfExpr : public TypedExpr
 public:
     typedef TypedExpr Super;
 
+    static const Tag kFirstTag = Tag::SelfPath;
+    static const Tag kLastTag = Tag::SelfPath;
+
     SelfExpr(SourceRangeInfo const& info, PatternDeclBase* decl, SelfExpr* parent, Classifier classifier)
         : Super(Tag::SelfPath, info, classifier)
         , _decl(decl)
@@ -472,6 +705,9 @@ class SlotExpr : public TypedExpr
 public:
     typedef TypedExpr Super;
 
+    static const Tag kFirstTag = Tag::SlotPath;
+    static const Tag kLastTag = Tag::SlotPath;
+
     SlotExpr(SourceRangeInfo const& info, Expr* base, Decl* decl, Classifier classifier)
         : Super(Tag::SlotPath, info, classifier)
         , _base(base)
@@ -488,6 +724,9 @@ class CastToBaseExpr : public TypedExpr
 public:
     typedef TypedExpr Super;
 
+    static const Tag kFirstTag = Tag::CastToBaseExpr;
+    static const Tag kLastTag = Tag::CastToBaseExpr;
+
     CastToBaseExpr(SourceRangeInfo const& info, Expr* base, int baseIndex, Classifier classifier)
         : Super(Tag::CastToBaseExpr, info, classifier)
         , _base(base)
@@ -505,6 +744,9 @@ class OriginExpr : public TypedExpr
 public:
     typedef TypedExpr Super;
 
+    static const Tag kFirstTag = Tag::OriginPath;
+    static const Tag kLastTag = Tag::OriginPath;
+
     OriginExpr(SourceRangeInfo const& info, Expr* base, Classifier classifier)
         : Super(Tag::OriginPath, info, classifier)
         , _base(base)
@@ -520,7 +762,14 @@ public:
 template<typename T>
 T* as(Node* node)
 {
-    return dynamic_cast<T*>(node);
+    if (!node)
+        return nullptr;
+
+    auto tag = node->getTag();
+    if (tag < T::kFirstTag || tag > T::kLastTag)
+        return nullptr;
+
+    return static_cast<T*>(node);
 }
 
 }
@@ -0,0 +1,260 @@
+// task-pool.h
+#pragma once
+
+namespace theta
+{
+
+    // A fixed set of worker threads that run fork/join tasks.
+    //
+    // Each worker has its own deque of tasks: it pushes and pops new
+    // work at the back, while idle workers steal from the front of
+    // other workers' deques. The thread that owns the pool counts as
+    // worker zero, and helps run tasks while it waits for them.
+    //
+struct TaskPool
+{
+public:
+        // Create a pool with `threadCount` threads in addition to
+        // the calling thread.
+    explicit TaskPool(Count threadCount)
+    {
+        _workerCount = threadCount + 1;
+        _workers = new Worker[_workerCount];
+
+        for (Index i = 1; i < _workerCount; i++)
+        {
+            _workers[i]._thread = std::thread([this, i]()
+            {
+                getCurrentWorkerIndexRef() = i;
+                runWorker(i);
+            });
+        }
+    }
+
+    ~TaskPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_wakeMutex);
+            _isStopping = true;
+        }
+        _wake.notify_all();
+
+        for (Index i = 1; i < _workerCount; i++)
+            _workers[i]._thread.join();
+
+        delete[] _workers;
+    }
+
+    TaskPool(TaskPool const&) = delete;
+    TaskPool& operator=(TaskPool const&) = delete;
+
+    Count getWorkerCount() const { return _workerCount; }
+
+        // The index of the worker running the current thread (zero
+        // for any thread that isn't one of the pool's own).
+    static Index getCurrentWorkerIndex()
+    {
+        return getCurrentWorkerIndexRef();
+    }
+
+        // Run `body(i)` for each `i` in `[0, count)`, possibly in
+        // parallel, and wait for all of them to finish.
+        //
+        // If any of the calls throws, the exception from the lowest
+        // such `i` is re-thrown once all of them are done, so that
+        // which error gets reported doesn't depend on scheduling.
+        //
+    template<typename F>
+    void parallelFor(Count count, F const& body)
+    {
+        std::vector<std::exception_ptr> errors(count);
+
+        TaskGroup group;
+        group._pendingCount = count;
+
+        std::vector<Task> tasks(count);
+        for (Index i = count; i-- > 0;)
+        {
+            Task& task = tasks[i];
+            task._group = &group;
+            task._body = [&body, &errors, i]()
+            {
+                try
+                {
+                    body(i);
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            };
+            push(&task);
+        }
+
+        wait(&group);
+
+        for (auto& error : errors)
+        {
+            if (error)
+                std::rethrow_exception(error);
+        }
+    }
+
+private:
+    struct TaskGroup
+    {
+        std::atomic<Count> _pendingCount;
+    };
+
+    struct Task
+    {
+        std::function<void()> _body;
+        TaskGroup* _group = nullptr;
+    };
+
+    struct Worker
+    {
+        std::mutex _mutex;
+        std::deque<Task*> _tasks;
+        std::thread _thread;
+    };
+
+    static Index& getCurrentWorkerIndexRef()
+    {
+        static thread_local Index index = 0;
+        return index;
+    }
+
+    void push(Task* task)
+    {
+        Worker& worker = _workers[getCurrentWorkerIndex()];
+        {
+            std::lock_guard<std::mutex> lock(worker._mutex);
+            worker._tasks.push_back(task);
+        }
+
+        _queuedCount++;
+        if (_sleepingCount.load())
+        {
+            std::lock_guard<std::mutex> lock(_wakeMutex);
+            _wake.notify_one();
+        }
+    }
+
+        // Take the newest task from our own deque, or else the
+        // oldest task from somebody else's.
+    Task* findTask(Index workerIndex)
+    {
+        {
+            Worker& worker = _workers[workerIndex];
+            std::lock_guard<std::mutex> lock(worker._mutex);
+            if (!worker._tasks.empty())
+            {
+                Task* task = worker._tasks.back();
+                worker._tasks.pop_back();
+                _queuedCount--;
+                return task;
+            }
+        }
+
+        for (Index offset = 1; offset < _workerCount; offset++)
+        {
+            Worker& victim = _workers[(workerIndex + offset) % _workerCount];
+            std::lock_guard<std::mutex> lock(victim._mutex);
+            if (!victim._tasks.empty())
+            {
+                Task* task = victim._tasks.front();
+                victim._tasks.pop_front();
+                _queuedCount--;
+                return task;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void execute(Task* task)
+    {
+        TaskGroup* group = task->_group;
+        task->_body();
+
+        // The last task in a group wakes whoever is waiting on it
+        // (`group` may be gone as soon as the count reaches zero).
+        //
+        if (--group->_pendingCount == 0)
+        {
+            std::lock_guard<std::mutex> lock(_wakeMutex);
+            _wake.notify_all();
+        }
+    }
+
+        // Help run tasks until everything in `group` is done, and
+        // sleep while the tasks that are left are running elsewhere.
+    void wait(TaskGroup* group)
+    {
+        Index workerIndex = getCurrentWorkerIndex();
+        while (group->_pendingCount.load() != 0)
+        {
+            if (Task* task = findTask(workerIndex))
+            {
+                execute(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(_wakeMutex);
+            _sleepingCount++;
+            _wake.wait(lock, [&]() { return group->_pendingCount.load() == 0 || _queuedCount.load() != 0; });
+            _sleepingCount--;
+        }
+    }
+
+    void runWorker(Index workerIndex)
+    {
+        for (;;)
+        {
+            if (Task* task = findTask(workerIndex))
+            {
+                execute(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(_wakeMutex);
+            _sleepingCount++;
+            _wake.wait(lock, [&]() { return _isStopping || _queuedCount.load() != 0; });
+            _sleepingCount--;
+
+            if (_isStopping)
+                return;
+        }
+    }
+
+    Worker* _workers = nullptr;
+    Count _workerCount = 0;
+
+        // Tasks sitting in some worker's deque
+    std::atomic<Count> _queuedCount{0};
+
+        // Idle workers (and threads waiting on a group) sleep until
+        // there are tasks to steal
+    std::mutex _wakeMutex;
+    std::condition_variable _wake;
+    std::atomic<Count> _sleepingCount{0};
+    bool _isStopping = false;
+};
+
+    // Run `body(i)` for each `i` in `[0, count)`, on `pool` if there
+    // is one (and it's worth it), and otherwise in order.
+    //
+template<typename F>
+void parallelFor(TaskPool* pool, Count count, F const& body)
+{
+    if (!pool || pool->getWorkerCount() < 2 || count < 2)
+    {
+        for (Index i = 0; i < count; i++)
+            body(i);
+        return;
+    }
+    pool->parallelFor(count, body);
+}
+
+}
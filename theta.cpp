@@ -6,51 +6,263 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
 #include <new>
+#include <thread>
 
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <vector>
 
+#include "arena.h"
 #include "bytecode.h"
+#include "bytecode-image.h"
+#include "compile-cache.h"
 #include "diagnostics.h"
 #include "emit.h"
 #include "lexer.h"
+#include "link.h"
 #include "parser.h"
+#include "peephole.h"
 #include "semantics.h"
 #include "source-manager.h"
 #include "string.h"
+#include "task-pool.h"
 #include "token.h"
+#include "token-buffer.h"
 #include "value.h"
+#include "verify.h"
 #include "vm.h"
 
 using namespace theta;
 
-int main(int argc, char** argv)
+    // Compile the program in `sourceFile` (or streamed from stdin,
+    // if it is null) to bytecode, reusing whatever `cache` (if any)
+    // has for unchanged declarations.
+    //
+    // With `lexAsync`, a resident file is lexed into a token buffer
+    // on a worker thread while the parser consumes it.
+    //
+bytecode::BCDecl* compileProgram(SourceFile* sourceFile, CompilationCache* cache, bool lexAsync)
 {
     using namespace semantics;
 
-    auto sourceFile = loadSourceFile("test.theta");
+    bool isStdin = sourceFile == nullptr;
+
+    // Independent sibling declarations are checked and emitted in
+    // parallel, using any spare hardware threads.
+    //
+    Count hardwareThreadCount = Count(std::thread::hardware_concurrency());
+    TaskPool taskPool(hardwareThreadCount > 1 ? hardwareThreadCount - 1 : 0);
+
+    // All AST nodes for this compilation live in one arena (plus
+    // one per task pool worker), and are released together when
+    // they go out of scope.
+    //
+    MemoryArena astArena;
+    WorkerNodeArenas workerArenas(taskPool.getWorkerCount());
+    WithNodeArena withNodeArena(&astArena);
+
+    FileLexerInput stdinInput(stdin);
 
+    // Tokens are lexed on demand unless async lexing was asked for.
+    // Streamed input is only ever partly in memory, so it is always
+    // lexed on demand.
+    //
+    // Async lexing is opt-in because it has only been measured on a
+    // single core, where the extra pass costs more than it saves, and
+    // while it runs every symbol lookup takes the symbol table lock.
+    //
+    bool useTokenBuffer = lexAsync && !isStdin;
+
+    SymbolTable::WithConcurrentAccess withConcurrentSymbols(useTokenBuffer ? &gSymbols : nullptr);
     Lexer lexer;
-    lexer.init(sourceFile->_text);
+    TokenBuffer tokens;
 
     Parser parser;
-    parser.init(&lexer);
+    if (useTokenBuffer)
+    {
+        tokens.lexAsync(sourceFile->_text);
+        parser.init(&tokens);
+    }
+    else
+    {
+        if (isStdin)
+            lexer.init(&stdinInput);
+        else
+            lexer.init(sourceFile->_text);
+        parser.init(&lexer);
+    }
 
     auto astProgram = parser.parseProgram();
+    tokens.finish();
+
+    if (cache)
+        cache->computeKeys(astProgram);
 
-    Checker checker;
+    Checker checker(&taskPool, &workerArenas, cache);
     checker.checkProgram(astProgram);
 
-    bytecode::Emitter emitter;
-    auto bcProgram = emitter.emitProgram(astProgram);
+    bytecode::Emitter emitter(&taskPool, cache);
+    emitter._optimize = true;
+    return emitter.emitProgram(astProgram);
+}
+
+    // Usage: theta [-c <image>] [-cache <cache>] [-lex-async]
+    //              [-gc-stress] [-gc-stats] [<path>]
+    //
+    // The program at `path` may be either source or a bytecode image
+    // (which is run without compiling it). A path of `-` means source
+    // is streamed from stdin, without ever holding all of it in memory.
+    //
+    // With `-c`, the compiled program is saved to `image` instead
+    // of being run.
+    //
+    // With `-cache`, the bytecode for each declaration is kept in
+    // `cache` between runs, and only the declarations that changed
+    // since the last run are checked and emitted again.
+    //
+    // With `-lex-async`, source is lexed on a worker thread while
+    // it is being parsed.
+    //
+    // With `-gc-stress`, the VM collects garbage at every point where
+    // it might allocate, and with `-gc-stats` it reports what its
+    // collections did once the program has run.
+    //
+int run(int argc, char** argv)
+{
+    char const* imagePath = nullptr;
+    char const* cachePath = nullptr;
+    bool lexAsync = false;
+    bool gcStress = false;
+    bool gcStats = false;
+
+    int argIndex = 1;
+    while (argIndex < argc)
+    {
+        bool* flag = nullptr;
+        if (strcmp(argv[argIndex], "-lex-async") == 0)
+            flag = &lexAsync;
+        else if (strcmp(argv[argIndex], "-gc-stress") == 0)
+            flag = &gcStress;
+        else if (strcmp(argv[argIndex], "-gc-stats") == 0)
+            flag = &gcStats;
+        if (flag)
+        {
+            *flag = true;
+            argIndex++;
+            continue;
+        }
 
-    vm::VM vm;
-    vm.execute(bcProgram);
+        if (argIndex + 1 >= argc)
+            break;
+        if (strcmp(argv[argIndex], "-c") == 0)
+            imagePath = argv[argIndex + 1];
+        else if (strcmp(argv[argIndex], "-cache") == 0)
+            cachePath = argv[argIndex + 1];
+        else
+            break;
+        argIndex += 2;
+    }
 
+    char const* path = argIndex < argc ? argv[argIndex] : "test.theta";
+    bool isStdin = strcmp(path, "-") == 0;
+
+    SourceFile* sourceFile = nullptr;
+    if (!isStdin)
+    {
+        sourceFile = loadSourceFile(path);
+        if (!sourceFile)
+        {
+            fprintf(stderr, "error: could not open '%s'\n", path);
+            return 1;
+        }
+    }
+
+    // A compiled image is run as-is, so the cache (if any) is only
+    // loaded when there is source to compile.
+    //
+    CompilationCache cache;
+    bytecode::BCImage* image = nullptr;
+    bytecode::BCDecl* bcProgram = nullptr;
+    if (sourceFile && bytecode::isBCImage(sourceFile->_text))
+    {
+        image = bytecode::loadBCImage(sourceFile->_text);
+        bcProgram = image->getProgram();
+    }
+    else
+    {
+        if (cachePath)
+            cache.load(cachePath);
+
+        bcProgram = compileProgram(sourceFile, cachePath ? &cache : nullptr, lexAsync);
+
+        if (cachePath)
+            cache.save(cachePath, bcProgram);
+    }
+
+    if (sourceFile)
+        unloadSourceFile(sourceFile);
+
+    if (imagePath)
+    {
+        bytecode::saveBCImage(imagePath, bcProgram);
+    }
+    else
+    {
+        vm::VM vm;
+        vm._gcStressMode = gcStress;
+        vm.execute(bcProgram);
+
+        if (gcStats)
+            vm.dumpGCStats();
+    }
+
+    delete image;
     return 0;
 }
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        return run(argc, argv);
+    }
+    catch (Error const& e)
+    {
+        reportError(e);
+        return 1;
+    }
+}
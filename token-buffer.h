@@ -0,0 +1,299 @@
+// token-buffer.h
+#pragma once
+
+#include "lexer.h"
+
+namespace theta
+{
+
+    // The tokens of a whole source file, lexed ahead of parsing.
+    //
+    // Tokens are stored as a struct of arrays (codes, text offsets and
+    // sizes, and symbols) rather than as an array of `Token`s, so that
+    // the parser's common question ("what is the code of the token
+    // `k` ahead?") touches one byte per token.
+    //
+    // The arrays are split into fixed-size blocks, so that a buffer
+    // being filled by a worker thread never moves tokens that the
+    // parser might already be looking at.
+    //
+    // Only resident text can be buffered, since tokens refer to their
+    // text by offset.
+    //
+struct TokenBuffer
+{
+public:
+    enum
+    {
+        kBlockShift = 12,
+        kBlockSize  = 1 << kBlockShift,
+        kBlockMask  = kBlockSize - 1,
+    };
+
+    TokenBuffer()
+    {}
+
+    ~TokenBuffer()
+    {
+        if (_thread.joinable())
+            _thread.join();
+
+        for (Index i = 0; i < _blockCount; i++)
+            free(_blocks[i]);
+        free(_blocks);
+        free(_spareBlock);
+    }
+
+    TokenBuffer(TokenBuffer const&) = delete;
+    TokenBuffer& operator=(TokenBuffer const&) = delete;
+
+        // Lex all of `text` on the calling thread
+    void lex(StringSpan const& text)
+    {
+        begin(text);
+        fill();
+    }
+
+        // Start lexing `text` on a worker thread.
+        //
+        // Tokens become visible to readers a block at a time. Symbols
+        // are interned from the worker thread, so the caller must keep
+        // a `SymbolTable::WithConcurrentAccess` scope open on `gSymbols`
+        // until `finish()` returns.
+        //
+    void lexAsync(StringSpan const& text)
+    {
+        begin(text);
+
+        // A block for the final `EndOfFile` token is set aside up
+        // front, so that ending the input early can't itself fail.
+        //
+        _spareBlock = allocateBlock();
+
+        _thread = std::thread([this]()
+        {
+            try
+            {
+                fill();
+            }
+            catch (...)
+            {
+                // Readers see the input end where the error was hit,
+                // and the error itself is re-thrown by `finish()`.
+                //
+                _error = std::current_exception();
+                if ((_producedCount >> kBlockShift) == _blockCount)
+                {
+                    _blocks[_blockCount++] = _spareBlock;
+                    _spareBlock = nullptr;
+                }
+                append(_producedCount++, Token::Code::EndOfFile, nullptr, StringSpan(_text._end, _text._end));
+                publish(true);
+            }
+        });
+    }
+
+        // Wait for any worker thread to finish, and re-throw any
+        // error that it hit.
+    void finish()
+    {
+        if (_thread.joinable())
+            _thread.join();
+
+        if (_error)
+        {
+            std::exception_ptr error = _error;
+            _error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+        // Accessors for the token at `index`.
+        //
+        // An index past the end of the input refers to the final
+        // `EndOfFile` token. When the buffer is being filled by a
+        // worker thread these block until the token is available.
+        //
+    Token::Code getCode(Index index)
+    {
+        index = waitFor(index);
+        return Token::Code(getBlock(index)->codes[index & kBlockMask]);
+    }
+
+    Symbol* getSymbol(Index index)
+    {
+        index = waitFor(index);
+        return getBlock(index)->symbols[index & kBlockMask];
+    }
+
+    StringSpan getText(Index index)
+    {
+        index = waitFor(index);
+        Block* block = getBlock(index);
+        char const* textBegin = _text._begin + block->offsets[index & kBlockMask];
+        return StringSpan(textBegin, textBegin + block->sizes[index & kBlockMask]);
+    }
+
+    Token getToken(Index index)
+    {
+        index = waitFor(index);
+        Block* block = getBlock(index);
+
+        Token token;
+        token.code = Token::Code(block->codes[index & kBlockMask]);
+        token.value.symbol = block->symbols[index & kBlockMask];
+
+        char const* textBegin = _text._begin + block->offsets[index & kBlockMask];
+        token.text = StringSpan(textBegin, textBegin + block->sizes[index & kBlockMask]);
+        return token;
+    }
+
+private:
+    struct Block
+    {
+        uint8_t     codes[kBlockSize];
+        uint32_t    offsets[kBlockSize];
+        uint32_t    sizes[kBlockSize];
+        Symbol*     symbols[kBlockSize];
+    };
+
+    void begin(StringSpan const& text)
+    {
+        assert(!_blocks);
+
+        if (text.getSize() >= UINT32_MAX)
+            error(SourceLoc(), "source file is too large to pre-tokenize");
+
+        _text = text;
+
+        // Every token but the last consumes at least one character,
+        // which bounds the number of blocks we can need. Sizing the
+        // block table up front means it never moves under a reader.
+        //
+        Count maxTokenCount = Count(text.getSize()) + 1;
+        _blockCapacity = (maxTokenCount >> kBlockShift) + 1;
+        _blocks = (Block**) calloc(_blockCapacity, sizeof(Block*));
+        if (!_blocks)
+            throw std::bad_alloc();
+    }
+
+    void fill()
+    {
+        Lexer lexer;
+        lexer.init(_text);
+
+        for (;;)
+        {
+            Token token = lexer.readToken();
+            append(_producedCount++, token.code, token.value.symbol, token.text);
+
+            if (token.code == Token::Code::EndOfFile)
+                break;
+
+            if ((_producedCount & kBlockMask) == 0)
+                publish(false);
+        }
+        publish(true);
+    }
+
+    void append(Index index, Token::Code code, Symbol* symbol, StringSpan const& text)
+    {
+        Index blockIndex = index >> kBlockShift;
+        assert(blockIndex < _blockCapacity);
+        if (blockIndex == _blockCount)
+        {
+            _blocks[blockIndex] = allocateBlock();
+            _blockCount++;
+        }
+
+        static_assert(sizeof(kTokenCodeNames) / sizeof(kTokenCodeNames[0]) <= 256, "token codes must fit in a byte");
+
+        Block* block = _blocks[blockIndex];
+        Index slot = index & kBlockMask;
+        block->codes[slot] = uint8_t(code);
+        block->offsets[slot] = uint32_t(text._begin - _text._begin);
+        block->sizes[slot] = uint32_t(text.getSize());
+        block->symbols[slot] = isNameToken(code) ? symbol : nullptr;
+    }
+
+    static Block* allocateBlock()
+    {
+        Block* block = (Block*) malloc(sizeof(Block));
+        if (!block)
+            throw std::bad_alloc();
+        return block;
+    }
+
+    static bool isNameToken(Token::Code code)
+    {
+        return code == Token::Code::Identifier
+            || code == Token::Code::InfixOperator;
+    }
+
+        // Make the tokens produced so far visible to readers
+    void publish(bool isDone)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _publishedCount = _producedCount;
+            _isDone = isDone;
+        }
+        _published.notify_all();
+    }
+
+        // Wait until the token at `index` has been published, and
+        // return the index to actually read (clamped to the final
+        // `EndOfFile` token).
+        //
+    Index waitFor(Index index)
+    {
+        if (index < _readableCount)
+            return index;
+
+        if (!_isReadableDone)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _published.wait(lock, [&]() { return _isDone || index < _publishedCount; });
+            _readableCount = _publishedCount;
+            _isReadableDone = _isDone;
+        }
+
+        if (index >= _readableCount)
+        {
+            assert(_isReadableDone);
+            return _readableCount - 1;
+        }
+        return index;
+    }
+
+    Block* getBlock(Index index)
+    {
+        return _blocks[index >> kBlockShift];
+    }
+
+    StringSpan _text;
+
+    Block** _blocks = nullptr;
+    Count _blockCapacity = 0;
+
+        // Written only by the producer
+    Count _blockCount = 0;
+    Count _producedCount = 0;
+    Block* _spareBlock = nullptr;
+
+        // Shared between producer and reader, guarded by `_mutex`
+    std::mutex _mutex;
+    std::condition_variable _published;
+    Count _publishedCount = 0;
+    bool _isDone = false;
+
+        // The reader's view of what has been published, so that
+        // the common case doesn't need to take the lock
+    Count _readableCount = 0;
+    bool _isReadableDone = false;
+
+    std::thread _thread;
+    std::exception_ptr _error;
+};
+
+}
@@ -1,40 +1,137 @@
 // value.h
 #pragma once
 
+#include "arena.h"
 #include "string.h"
 
 namespace theta
 {
 
+    // Base for all heap-allocated values.
+    //
+    // As with `ast::Node`, the tags are ordered so that each class
+    // covers a contiguous range (`kFirstTag` through `kLastTag`),
+    // which lets `as<T>()` test the type with a range check.
+    //
 struct ValueObj
 {
+    enum class Tag : uint8_t
+    {
+        Symbol,
+
+        // Pattern
+        //   SimplePattern
+        EmptyPattern,
+        Mixin,
+
+        Object,
+        Part,
+    };
+
+    static const Tag kFirstTag = Tag::Symbol;
+    static const Tag kLastTag = Tag::Part;
+
+    ValueObj(Tag tag)
+        : _tag(tag)
+    {}
+
     virtual ~ValueObj() {}
+
+    Tag getTag() const { return _tag; }
+
+private:
+    Tag _tag;
 };
 
+template<typename T>
+T* as(ValueObj* obj)
+{
+    if (!obj)
+        return nullptr;
+
+    auto tag = obj->getTag();
+    if (tag < T::kFirstTag || tag > T::kLastTag)
+        return nullptr;
+
+    return static_cast<T*>(obj);
+}
+
+    // A `Value` is a single tagged word.
+    //
+    // If the low bit is set, the remaining bits hold a signed integer
+    // inline, so that integers never need a heap allocation. Otherwise
+    // the word is a (suitably aligned) `ValueObj*`, possibly null.
+    //
 struct Value
 {
 public:
+    enum : uintptr_t
+    {
+        kIntTag = 1,
+    };
+
+    static const Int kMinImmediateInt = INTPTR_MIN >> 1;
+    static const Int kMaxImmediateInt = INTPTR_MAX >> 1;
+
     Value()
     {}
 
     Value(ValueObj* obj)
-        : _obj(obj)
-    {}
+        : _bits(uintptr_t(obj))
+    {
+        assert(!(_bits & kIntTag));
+    }
+
+    static bool canBeImmediateInt(Int value)
+    {
+        return value >= kMinImmediateInt && value <= kMaxImmediateInt;
+    }
+
+    static Value fromInt(Int value)
+    {
+        assert(canBeImmediateInt(value));
+
+        Value result;
+        result._bits = (uintptr_t(value) << 1) | kIntTag;
+        return result;
+    }
 
     bool operator==(Value const& other)
     {
-        return _obj == other._obj;
+        return _bits == other._bits;
     }
 
     bool operator!=(Value const& other)
     {
-        return _obj != other._obj;
+        return _bits != other._bits;
+    }
+
+    bool isInt() const { return (_bits & kIntTag) != 0; }
+    bool isNull() const { return _bits == 0; }
+
+        // True if this value refers to a (non-null) heap object
+    bool isObj() const { return !isInt() && !isNull(); }
+
+    Int getInt() const
+    {
+        assert(isInt());
+        return Int(intptr_t(_bits) >> 1);
+    }
+
+        // The referenced object, or null if this value isn't an object reference
+    ValueObj* getPtr() const { return isInt() ? nullptr : (ValueObj*) _bits; }
+
+        // Fast path for when the value is already known to be an object reference (or null)
+    ValueObj* getObj() const
+    {
+        assert(!isInt());
+        return (ValueObj*) _bits;
     }
 
-    ValueObj* getPtr() const { return _obj; }
+    uintptr_t getBits() const { return _bits; }
 
 private:
-    ValueObj* _obj = nullptr;
+    uintptr_t _bits = 0;
 };
 
 // Symbol
@@ -42,39 +139,164 @@ private:
 class Symbol : public ValueObj
 {
 public:
+    static const Tag kFirstTag = Tag::Symbol;
+    static const Tag kLastTag = Tag::Symbol;
+
+    Symbol()
+        : ValueObj(Tag::Symbol)
+    {}
+
     StringSpan  text;
-    Symbol*     next;
+    size_t      hash;
 };
 
-Symbol* gSymbols = nullptr;
+inline size_t hashText(StringSpan const& text)
+{
+    // FNV-1a, which only needs a single pass over the text
+    size_t hash = size_t(14695981039346656037ull);
+    for (char const* c = text._begin; c != text._end; ++c)
+    {
+        hash ^= (unsigned char)(*c);
+        hash *= size_t(1099511628211ull);
+    }
+    return hash;
+}
 
-Symbol* getSymbol(StringSpan const& text)
+    // Interned symbols, stored in an open-addressing hash table.
+    //
+    // The symbols themselves (and their text) are allocated out
+    // of an arena that lives as long as the table, so a `Symbol*`
+    // never refers to memory owned by the source text.
+    //
+struct SymbolTable
 {
-    for( auto s = gSymbols; s; s = s->next )
+public:
+    ~SymbolTable()
     {
-        if(s->text == text)
-            return s;
+        free(_entries);
     }
 
-    size_t textSize = text.getSize();
+    Symbol* getSymbol(StringSpan const& text)
+    {
+        if (_concurrentUserCount)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return getSymbolImpl(text);
+        }
+        return getSymbolImpl(text);
+    }
+
+    Count getCount() const { return Count(_count); }
 
-    size_t totalSize = sizeof(Symbol) + textSize + 1;
-    void* memory = malloc(totalSize);
+        // Symbols may be interned from more than one thread for as
+        // long as at least one of these scopes is alive.
+        //
+        // The scope must be entered before any other thread starts
+        // using the table, and exited after they have all finished,
+        // so that the flag itself is never raced on.
+        //
+        // A null `table` makes the scope a no-op.
+        //
+    struct WithConcurrentAccess
+    {
+        WithConcurrentAccess(SymbolTable* table)
+            : _table(table)
+        {
+            if (_table)
+                _table->_concurrentUserCount++;
+        }
 
-    Symbol* symbol = new(memory) Symbol();
+        ~WithConcurrentAccess()
+        {
+            if (_table)
+                _table->_concurrentUserCount--;
+        }
 
-    char* textBegin = (char*) (symbol + 1);
-    char* textEnd = textBegin + textSize;
-    *textEnd = 0;
+        WithConcurrentAccess(WithConcurrentAccess const&) = delete;
+        WithConcurrentAccess& operator=(WithConcurrentAccess const&) = delete;
 
-    memcpy(textBegin, text.getData(), textSize);
+        SymbolTable* _table;
+    };
 
-    symbol->text = StringSpan(textBegin, textEnd);
+private:
+    Symbol* getSymbolImpl(StringSpan const& text)
+    {
+        size_t hash = hashText(text);
 
-    symbol->next = gSymbols;
-    gSymbols = symbol;
+        if (2 * (_count + 1) > _capacity)
+            grow();
 
-    return symbol;
+        size_t mask = _capacity - 1;
+        for (size_t index = hash & mask;; index = (index + 1) & mask)
+        {
+            Symbol* entry = _entries[index];
+            if (!entry)
+            {
+                Symbol* symbol = createSymbol(text, hash);
+                _entries[index] = symbol;
+                _count++;
+                return symbol;
+            }
+
+            if (entry->hash == hash && entry->text == text)
+                return entry;
+        }
+    }
+
+    Symbol* createSymbol(StringSpan const& text, size_t hash)
+    {
+        char* textBegin = _arena.allocateString(text);
+        char* textEnd = textBegin + text.getSize();
+
+        Symbol* symbol = new(_arena.allocate(sizeof(Symbol), alignof(Symbol))) Symbol();
+        symbol->text = StringSpan(textBegin, textEnd);
+        symbol->hash = hash;
+        return symbol;
+    }
+
+    void grow()
+    {
+        size_t oldCapacity = _capacity;
+        Symbol** oldEntries = _entries;
+
+        size_t newCapacity = oldCapacity ? oldCapacity * 2 : 1024;
+        Symbol** newEntries = (Symbol**) calloc(newCapacity, sizeof(Symbol*));
+        if (!newEntries)
+            throw std::bad_alloc();
+
+        size_t mask = newCapacity - 1;
+        for (size_t i = 0; i < oldCapacity; ++i)
+        {
+            Symbol* entry = oldEntries[i];
+            if (!entry)
+                continue;
+
+            size_t index = entry->hash & mask;
+            while (newEntries[index])
+                index = (index + 1) & mask;
+            newEntries[index] = entry;
+        }
+
+        free(oldEntries);
+        _entries = newEntries;
+        _capacity = newCapacity;
+    }
+
+    Symbol** _entries = nullptr;
+    size_t _capacity = 0;
+    size_t _count = 0;
+
+    MemoryArena _arena;
+
+    std::mutex _mutex;
+    Count _concurrentUserCount = 0;
+};
+
+SymbolTable gSymbols;
+
+Symbol* getSymbol(StringSpan const& text)
+{
+    return gSymbols.getSymbol(text);
 }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,259 @@
+// verify.h
+#pragma once
+
+#include "bytecode.h"
+
+namespace theta
+{
+namespace bytecode
+{
+
+    // Checks on bytecode that comes from outside the compiler (a
+    // bytecode image, or a compilation cache), made once when it is
+    // loaded so that the VM doesn't have to check as it runs.
+    //
+    // Every chunk must decode cleanly and end in a `Return`, and for
+    // each instruction:
+    //
+    // * constant indices must be in range of the chunk's pool;
+    //
+    // * slots of `self` or of an outer part must be in range of the
+    //   slot count of the decl that part is created from, and outer
+    //   parts must exist;
+    //
+    // * member indices must be in range of the decl's members;
+    //
+    // * the instruction must not pop more values than the chunk has
+    //   pushed, and the values it pops must be of the kind it expects.
+    //
+    // The kind of each value on the stack is tracked from the
+    // instruction that pushed it: constants are never objects, while
+    // `GetSelfPart` pushes a part, `CreateMemberPattern` a mixin, and
+    // so on. So `Constant 0; GetPartSlot 0` is rejected, since the VM
+    // would treat a number as a part.
+    //
+    // A value read from a slot can be of any kind (slots aren't typed)
+    // and is accepted wherever a value is expected, as is anything
+    // that depends on which pattern a part came from at run time, such
+    // as the slot index of a `GetPartSlot`. Those remain up to the
+    // compiler that wrote the image.
+    //
+struct BytecodeVerifier
+{
+public:
+        // Verify the code of `decl` (but not of its members)
+    void verifyDecl(BCDecl const* decl)
+    {
+        // Init code runs in the part of the enclosing decl (and so
+        // the program's own init code has no `self` to speak of),
+        // while body code runs in a part for the decl itself.
+        //
+        verifyChunk(decl->initCode, decl, decl->parent);
+        verifyChunk(decl->bodyCode, decl, decl);
+    }
+
+private:
+        // What is known about a value on the stack
+    enum class Kind : Byte
+    {
+        Any,        // read from a slot
+        Other,      // a constant: null, a number or a symbol
+        Part,
+        Mixin,
+        Pattern,    // a pattern that might not be a mixin
+        Object,
+    };
+
+    void verifyChunk(CodeChunk const& chunk, BCDecl const* frameDecl, BCDecl const* selfDecl)
+    {
+        Count constantCount = Count(chunk._constants.size());
+        _depth = 0;
+
+        Byte const* cursor = chunk._bytes.data();
+        Byte const* end = cursor + chunk._bytes.size();
+        for (;;)
+        {
+            Instruction instruction;
+            decodeCheckedInstruction(cursor, end, instruction);
+            unsigned int operand0 = instruction.operands[0];
+            unsigned int operand1 = instruction.operands[1];
+
+            switch (instruction.opcode)
+            {
+            case Opcode::Nop:
+            case Opcode::Inner:
+                break;
+
+            case Opcode::Return:
+                if (cursor != end)
+                    invalid("code after return");
+                return;
+
+            case Opcode::Constant:
+                checkIndex(operand0, constantCount, "constant");
+                push(Kind::Other);
+                break;
+
+            case Opcode::Pop:
+                pop(Kind::Any);
+                break;
+
+            case Opcode::GetSelfSlot:
+                checkIndex(operand0, getSlotCount(getOuterDecl(selfDecl, 0)), "slot");
+                push(Kind::Any);
+                break;
+
+            case Opcode::SetSelfSlot:
+                checkIndex(operand0, getSlotCount(getOuterDecl(selfDecl, 0)), "slot");
+                pop(Kind::Any);
+                break;
+
+            case Opcode::GetOuterSlot:
+                checkIndex(operand1, getSlotCount(getOuterDecl(selfDecl, operand0)), "slot");
+                push(Kind::Any);
+                break;
+
+            case Opcode::GetPartSlot:
+                pop(Kind::Part);
+                push(Kind::Any);
+                break;
+
+            case Opcode::SetPartSlot:
+                pop(Kind::Any);
+                pop(Kind::Part);
+                break;
+
+            case Opcode::GetSelfPart:
+                getOuterDecl(selfDecl, 0);
+                push(Kind::Part);
+                break;
+
+            case Opcode::GetOuterPart:
+                getOuterDecl(selfDecl, operand0);
+                push(Kind::Part);
+                break;
+
+            case Opcode::GetOuterPartOf:
+            case Opcode::GetBasePart:
+                pop(Kind::Part);
+                push(Kind::Part);
+                break;
+
+            case Opcode::GetMixinFromPart:
+                pop(Kind::Part);
+                push(Kind::Mixin);
+                break;
+
+            case Opcode::GetOriginPartFromMixin:
+                pop(Kind::Mixin);
+                push(Kind::Part);
+                break;
+
+            case Opcode::CreatePatternFromMainPart:
+                push(Kind::Mixin);
+                break;
+
+            case Opcode::CreatePatternFromBaseAndMainPart:
+                pop(Kind::Mixin);
+                push(Kind::Mixin);
+                break;
+
+            case Opcode::CreateMemberPattern:
+                checkIndex(operand0, Count(frameDecl->getMembers().size()), "member");
+                push(Kind::Mixin);
+                break;
+
+            case Opcode::CreateMemberPatternFromBase:
+                checkIndex(operand0, Count(frameDecl->getMembers().size()), "member");
+                pop(Kind::Mixin);
+                push(Kind::Mixin);
+                break;
+
+            case Opcode::GetEmptyPattern:
+                push(Kind::Pattern);
+                break;
+
+            case Opcode::CreateObject:
+                pop(Kind::Pattern);
+                push(Kind::Object);
+                break;
+
+            default:
+                error(SourceLoc(), "invalid bytecode (unsupported opcode %u)", unsigned(instruction.opcode));
+                break;
+            }
+        }
+    }
+
+        // The decl that the part `levelCount` levels out from `self`
+        // is created from
+    BCDecl const* getOuterDecl(BCDecl const* selfDecl, unsigned int levelCount)
+    {
+        BCDecl const* decl = selfDecl;
+        for (unsigned int i = 0; decl && i < levelCount; i++)
+            decl = decl->parent;
+        if (!decl)
+            invalid("reference to a part that doesn't exist");
+        return decl;
+    }
+
+    static Count getSlotCount(BCDecl const* decl)
+    {
+        return Count(decl->_slotCount);
+    }
+
+    void push(Kind kind)
+    {
+        if (_depth == _stack.size())
+            _stack.push_back(kind);
+        else
+            _stack[_depth] = kind;
+        _depth++;
+    }
+
+        // Pop a value that an instruction expects to be of kind
+        // `expected` (where every mixin is also a pattern)
+    void pop(Kind expected)
+    {
+        if (_depth == 0)
+            invalid("stack underflow");
+        Kind kind = _stack[--_depth];
+
+        if (expected == Kind::Any || kind == Kind::Any || kind == expected)
+            return;
+        if (expected == Kind::Pattern && kind == Kind::Mixin)
+            return;
+        error(SourceLoc(), "invalid bytecode (expected %s on the stack)", getKindName(expected));
+    }
+
+    static char const* getKindName(Kind kind)
+    {
+        switch (kind)
+        {
+        case Kind::Part:    return "a part";
+        case Kind::Mixin:   return "a mixin";
+        case Kind::Pattern: return "a pattern";
+        case Kind::Object:  return "an object";
+        default:            return "a value";
+        }
+    }
+
+    void checkIndex(unsigned int index, Count count, char const* what)
+    {
+        if (Count(index) >= count)
+            error(SourceLoc(), "invalid bytecode (%s index %u out of range)", what, index);
+    }
+
+    void invalid(char const* reason)
+    {
+        error(SourceLoc(), "invalid bytecode (%s)", reason);
+    }
+
+        // The kinds of the values the chunk being verified has pushed
+        // (kept between chunks, so that it rarely has to grow)
+    std::vector<Kind> _stack;
+    size_t _depth = 0;
+};
+
+}
+}
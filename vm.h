@@ -2,6 +2,20 @@
 #pragma once
 
 #include "basic.h"
+#include "link.h"
+
+    // Select the dispatch loop used by `VM::execute()`.
+    //
+    // Direct threading ("computed goto") relies on the labels-as-values
+    // extension in GCC and Clang; other compilers use a `switch`.
+    //
+#ifndef THETA_USE_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define THETA_USE_COMPUTED_GOTO 1
+#else
+#define THETA_USE_COMPUTED_GOTO 0
+#endif
+#endif
 
 namespace theta
 {
@@ -56,6 +70,13 @@ struct MixinList
     // Base case for all patterns (e.g., including a pattern for `L & R`)
 struct Pattern : ValueObj
 {
+    static const Tag kFirstTag = Tag::EmptyPattern;
+    static const Tag kLastTag = Tag::Mixin;
+
+    Pattern(Tag tag)
+        : ValueObj(tag)
+    {}
+
     SimplePattern* getSimplePattern();
 
         // The mixin sequence that defines this pattern
@@ -70,10 +91,22 @@ struct Pattern : ValueObj
     // Common case for patterns, that are built out of a sequence of mixins
 struct SimplePattern : Pattern
 {
+    static const Tag kFirstTag = Tag::EmptyPattern;
+    static const Tag kLastTag = Tag::Mixin;
+
+    SimplePattern(Tag tag)
+        : Pattern(tag)
+    {}
+
     // The total size, in bytes, of instance objects created from this pattern
     size_t _instanceSize = 0;
 
     Size getInstanceSize() { return _instanceSize; }
+
+    // The number of objects that have been allocated with this pattern
+    Count _allocationCount = 0;
+
+    Count getAllocationCount() { return _allocationCount; }
 };
 
     // The empty pattern: used when we need to have a non-null object
@@ -81,6 +114,9 @@ struct SimplePattern : Pattern
 struct EmptyPattern : SimplePattern
 {
 public:
+    static const Tag kFirstTag = Tag::EmptyPattern;
+    static const Tag kLastTag = Tag::EmptyPattern;
+
     static EmptyPattern* get()
     {
         static EmptyPattern* result = new EmptyPattern();
@@ -88,28 +124,35 @@ public:
     }
 private:
     EmptyPattern()
+        : SimplePattern(Tag::EmptyPattern)
     {}
 };
 
     // The common case of patterns, where it one or more mixins
 struct Mixin : SimplePattern
 {
+    static const Tag kFirstTag = Tag::Mixin;
+    static const Tag kLastTag = Tag::Mixin;
+
     Mixin(
-        BCDecl const* decl,
+        DeclIndex decl,
+        Count slotCount,
         Part* origin,
         Mixin* next);
 
-    BCDecl const* getDecl() { return _decl; }
+    DeclIndex getDecl() { return _decl; }
     Part* getOrigin() { return _origin; }
-    Count getSlotCount() { return _decl->_slotCount; }
+    Count getSlotCount() { return _slotCount; }
 
     Offset getPartOffset() { return _partOffset; }
 
-    typedef BCDecl::MemberList MemberList;
-    MemberList const& getMembers() { return getDecl()->getMembers(); }
+        // The declaration (in the linked program) that corresponds
+        // to this "link" in the mixin chain
+    DeclIndex _decl = 0;
 
-        // The declaration that corresponds to this "link" in the mixin chain
-    BCDecl const* _decl = nullptr;
+        // The number of slots in a part for this mixin (copied from
+        // the decl, since the collector needs it for every part)
+    Count _slotCount = 0;
 
         // The origin part that corresponds to this "link" in the mixin chain
     Part* _origin = nullptr;
@@ -121,6 +164,9 @@ struct Mixin : SimplePattern
         // Note: a null pointer here is equivalent of the next link being the `EmptyPattern`
     Mixin* _next = nullptr;
 
+        // Set while this mixin is known to be reachable during a collection
+    bool _isMarked = false;
+
         // TODO: pointers to the mixins corresponding to the base(s) of this mixin
 };
 
@@ -176,13 +222,20 @@ private:
 
 struct Object : ValueObj
 {
+    static const Tag kFirstTag = Tag::Object;
+    static const Tag kLastTag = Tag::Object;
+
     Object(SimplePattern* pattern)
-        : _pattern(pattern)
+        : ValueObj(Tag::Object)
+        , _pattern(pattern)
     {}
 
         // The direct run-time pattern  that this object was created from
     SimplePattern* _pattern = nullptr;
 
+        // Set while this object is known to be reachable during a collection
+    bool _isMarked = false;
+
     SimplePattern* getPattern() { return _pattern; }
 
     // The remainder of an `Object`s state consists of tail-allocated
@@ -230,8 +283,12 @@ private:
 
 struct Part : ValueObj
 {
+    static const Tag kFirstTag = Tag::Part;
+    static const Tag kLastTag = Tag::Part;
+
     Part(Mixin* mixin)
-        : _mixin(mixin)
+        : ValueObj(Tag::Part)
+        , _mixin(mixin)
     {}
 
         // The mixin that this part corresponds to
@@ -243,7 +300,7 @@ struct Part : ValueObj
     }
 
     Mixin* getMixin() { return _mixin; }
-    BCDecl const* getDecl() { return getMixin()->getDecl(); }
+    DeclIndex getDecl() { return getMixin()->getDecl(); }
     Part* getOrigin() { return getMixin()->getOrigin(); }
 
     Part* getBase(Index baseIndex);
@@ -285,10 +342,13 @@ struct Part : ValueObj
 //
 
 Mixin::Mixin(
-    BCDecl const* decl,
+    DeclIndex decl,
+    Count slotCount,
     Part* origin,
     Mixin* next)
-    : _decl(decl)
+    : SimplePattern(Tag::Mixin)
+    , _decl(decl)
+    , _slotCount(slotCount)
     , _origin(origin)
     , _next(next)
 {
@@ -327,6 +387,9 @@ public:
     int indent = 0;
     bool atStartOfLine = true;
 
+        // The program that mixins' decl indices refer to
+    LinkedProgram const* program = nullptr;
+
     std::map<Symbol*, size_t> mapNameToIDCounter;
     std::map<void const*, size_t> mapPtrToID;
     std::set<void const*> seenPtrs;
@@ -428,13 +491,21 @@ public:
 
     void write(Value value)
     {
+        if (value.isInt())
+        {
+            char buffer[32];
+            sprintf(buffer, "%lld", (long long) value.getInt());
+            write(buffer);
+            return;
+        }
+
         auto obj = value.getPtr();
-        if (auto object = dynamic_cast<Object*>(obj))
+        if (auto object = as<Object>(obj))
         {
             write("object ");
             write(object);
         }
-        else if (auto pattern = dynamic_cast<Pattern*>(obj))
+        else if (auto pattern = as<Pattern>(obj))
         {
             write("pattern ");
             write(pattern);
@@ -505,7 +576,7 @@ public:
             writeName(origin);
             write(".");
         }
-        writeRef(mixin->_decl);
+        writeRef(program ? program->getDecl(mixin->_decl) : nullptr);
     }
 
     void writeRef(Mixin* mixin)
@@ -633,43 +704,883 @@ public:
     void decreaseIndent() { indent--; }
 };
 
-void dumpObject(Object* object)
+void dumpObject(Object* object, LinkedProgram const* program)
 {
     Writer writer;
     writer.file = stdout;
+    writer.program = program;
 
     writer.write(object);
 }
 
+    // Heap that `Object`s are allocated from.
+    //
+    // Small objects are grouped into size classes (by instance size,
+    // rounded up to `kGranularity`), and each size class bump-allocates
+    // out of its own pages, so that all the cells in a page have the
+    // same size. Pages come from the system already zeroed, so only
+    // cells recycled through a free list need to be cleared.
+    //
+    // Objects too large for any size class get an allocation of their own.
+    //
+    // Each page keeps a bitmap of which of its cells are allocated, so
+    // that a collector can `sweep()` the heap without knowing anything
+    // about where the objects came from.
+    //
+struct ObjectHeap
+{
+public:
+    enum
+    {
+        kGranularity = 16,
+        kSizeClassCount = 64,
+        kMaxSmallSize = kGranularity * kSizeClassCount,
+        kPageSize = 64 * 1024,
+        kMaxCellsPerPage = kPageSize / kGranularity,
+    };
+
+    ObjectHeap()
+    {}
+
+    ObjectHeap(ObjectHeap const&) = delete;
+    ObjectHeap& operator=(ObjectHeap const&) = delete;
+
+    ~ObjectHeap()
+    {
+        freePages(_pages);
+        freePages(_largePages);
+    }
+
+        // Allocate zero-initialized memory for an instance of `pattern`
+    void* allocate(SimplePattern* pattern)
+    {
+        pattern->_allocationCount++;
+        return allocate(pattern->getInstanceSize());
+    }
+
+        // Allocate `size` bytes of zero-initialized memory
+    void* allocate(Size size)
+    {
+        _allocationCount++;
+
+        if (size > kMaxSmallSize)
+        {
+            return allocateLarge(size);
+        }
+
+        SizeClass& sizeClass = _sizeClasses[getSizeClassIndex(size)];
+        sizeClass._allocationCount++;
+
+        if (auto cell = sizeClass._freeList)
+        {
+            sizeClass._freeList = cell->_next;
+
+            Page* page = cell->_page;
+            memset(cell, 0, sizeClass._cellSize);
+
+            page->setLive(page->getCellIndex(cell));
+            _allocatedSize += sizeClass._cellSize;
+            return cell;
+        }
+
+        if (sizeClass._cursor == sizeClass._end)
+        {
+            allocatePage(sizeClass);
+        }
+
+        char* cell = sizeClass._cursor;
+        sizeClass._cursor += sizeClass._cellSize;
+
+        Page* page = sizeClass._page;
+        page->setLive(page->getCellIndex(cell));
+        _allocatedSize += sizeClass._cellSize;
+        return cell;
+    }
+
+        // Visit every allocated cell, and release each one
+        // for which `isLive(cell)` returns `false`.
+        //
+        // Returns the number of bytes released.
+        //
+    template<typename F>
+    Size sweep(F const& isLive)
+    {
+        Size releasedSize = 0;
+
+        for (Page* page = _pages; page; page = page->_next)
+        {
+            SizeClass& sizeClass = _sizeClasses[getSizeClassIndex(page->_cellSize)];
+
+            for (Count wordIndex = 0; wordIndex < kLiveWordCount; ++wordIndex)
+            {
+                uint32_t bits = page->_liveBits[wordIndex];
+                for (Index bitIndex = 0; bits; ++bitIndex, bits >>= 1)
+                {
+                    if (!(bits & 1))
+                        continue;
+
+                    Index cellIndex = wordIndex * 32 + bitIndex;
+                    char* cell = page->getCell(cellIndex);
+                    if (isLive(cell))
+                        continue;
+
+                    page->clearLive(cellIndex);
+
+                    FreeCell* freeCell = (FreeCell*) cell;
+                    freeCell->_page = page;
+                    freeCell->_next = sizeClass._freeList;
+                    sizeClass._freeList = freeCell;
+
+                    releasedSize += page->_cellSize;
+                }
+            }
+        }
+
+        Page* page = _largePages;
+        while (page)
+        {
+            Page* next = page->_next;
+            if (!isLive(page->getCell(0)))
+            {
+                releasedSize += page->_cellSize;
+                releaseLarge(page);
+            }
+            page = next;
+        }
+
+        _allocatedSize -= releasedSize;
+        return releasedSize;
+    }
+
+        // Bytes currently allocated to objects (rounded up to their cell size)
+    Size getAllocatedSize() const { return _allocatedSize; }
+
+        // Bytes requested from the system for pages and large objects
+    Size getReservedSize() const { return _reservedSize; }
+
+    Count getAllocationCount() const { return _allocationCount; }
+
+    Count getSizeClassAllocationCount(Size size) const
+    {
+        return _sizeClasses[getSizeClassIndex(size)]._allocationCount;
+    }
+
+private:
+    enum
+    {
+        kLiveWordCount = kMaxCellsPerPage / 32,
+    };
+
+        // Header at the start of each page (or large object)
+    struct alignas(kGranularity) Page
+    {
+        Page* _next;
+        Page* _prev;
+        Size _cellSize;
+
+            // One bit per cell, set while the cell is allocated
+        uint32_t _liveBits[kLiveWordCount];
+
+        char* getCell(Index index)
+        {
+            return (char*)(this + 1) + index * _cellSize;
+        }
+
+        Index getCellIndex(void const* cell)
+        {
+            return Index(((char const*)cell - (char const*)(this + 1)) / _cellSize);
+        }
+
+        void setLive(Index index) { _liveBits[index / 32] |= uint32_t(1) << (index % 32); }
+        void clearLive(Index index) { _liveBits[index / 32] &= ~(uint32_t(1) << (index % 32)); }
+    };
+
+    struct FreeCell
+    {
+        FreeCell* _next;
+        Page* _page;
+    };
+
+    struct SizeClass
+    {
+        Size _cellSize = 0;
+        FreeCell* _freeList = nullptr;
+        Page* _page = nullptr;
+        char* _cursor = nullptr;
+        char* _end = nullptr;
+        Count _allocationCount = 0;
+    };
+
+    static Index getSizeClassIndex(Size size)
+    {
+        return size ? Index((size - 1) / kGranularity) : 0;
+    }
+
+    void allocatePage(SizeClass& sizeClass)
+    {
+        Page* page = (Page*) calloc(1, kPageSize);
+        if (!page)
+            throw std::bad_alloc();
+
+        _reservedSize += kPageSize;
+
+        if (!sizeClass._cellSize)
+        {
+            sizeClass._cellSize = Size(&sizeClass - _sizeClasses + 1) * kGranularity;
+        }
+
+        page->_cellSize = sizeClass._cellSize;
+        page->_next = _pages;
+        page->_prev = nullptr;
+        _pages = page;
+
+        // Only whole cells are handed out, so that the page can
+        // later be walked one cell at a time.
+        //
+        char* begin = page->getCell(0);
+        Count cellCount = (kPageSize - sizeof(Page)) / sizeClass._cellSize;
+
+        sizeClass._page = page;
+        sizeClass._cursor = begin;
+        sizeClass._end = begin + cellCount * sizeClass._cellSize;
+    }
+
+    void* allocateLarge(Size size)
+    {
+        Page* page = (Page*) calloc(1, sizeof(Page) + size);
+        if (!page)
+            throw std::bad_alloc();
+
+        _reservedSize += sizeof(Page) + size;
+        _allocatedSize += size;
+
+        page->_cellSize = size;
+        page->_prev = nullptr;
+        page->_next = _largePages;
+        if (_largePages)
+            _largePages->_prev = page;
+        _largePages = page;
+
+        return page->getCell(0);
+    }
+
+    void releaseLarge(Page* page)
+    {
+        if (page->_prev)
+            page->_prev->_next = page->_next;
+        else
+            _largePages = page->_next;
+        if (page->_next)
+            page->_next->_prev = page->_prev;
+
+        _reservedSize -= sizeof(Page) + page->_cellSize;
+        free(page);
+    }
+
+    static void freePages(Page* page)
+    {
+        while (page)
+        {
+            Page* next = page->_next;
+            free(page);
+            page = next;
+        }
+    }
+
+    SizeClass _sizeClasses[kSizeClassCount];
+
+    Page* _pages = nullptr;
+    Page* _largePages = nullptr;
+
+    Size _allocatedSize = 0;
+    Size _reservedSize = 0;
+    Count _allocationCount = 0;
+};
+
+    // Cache of the `Mixin`s a VM has created, so that evaluating
+    // the same pattern declaration, for the same origin part and
+    // base pattern, yields the same `Mixin` (with its layout already
+    // computed) instead of allocating a new one each time.
+    //
+struct MixinCache
+{
+public:
+    MixinCache()
+    {}
+
+    MixinCache(MixinCache const&) = delete;
+    MixinCache& operator=(MixinCache const&) = delete;
+
+    ~MixinCache()
+    {
+        for (size_t i = 0; i < _capacity; ++i)
+        {
+            delete _entries[i];
+        }
+        free(_entries);
+    }
+
+    Mixin* getMixin(DeclIndex decl, Count slotCount, Part* origin, Mixin* next)
+    {
+        _lookupCount++;
+
+        if (2 * (_count + 1) > _capacity)
+            grow();
+
+        size_t mask = _capacity - 1;
+        for (size_t index = hashKey(decl, origin, next) & mask;; index = (index + 1) & mask)
+        {
+            Mixin* entry = _entries[index];
+            if (!entry)
+            {
+                Mixin* mixin = new Mixin(decl, slotCount, origin, next);
+                _entries[index] = mixin;
+                _count++;
+                _mixinBytes += sizeof(Mixin);
+                return mixin;
+            }
+
+            if (entry->_decl == decl && entry->_origin == origin && entry->_next == next)
+            {
+                _hitCount++;
+                return entry;
+            }
+        }
+    }
+
+        // Delete every cached mixin for which `isLive(mixin)` returns
+        // `false`, and return the number of bytes released.
+    template<typename F>
+    Size sweep(F const& isLive)
+    {
+        Size releasedSize = 0;
+
+        // Open addressing doesn't let us just clear entries in place,
+        // so the survivors get re-inserted into a fresh table.
+        //
+        Mixin** newEntries = (Mixin**) calloc(_capacity, sizeof(Mixin*));
+        if (_capacity && !newEntries)
+            throw std::bad_alloc();
+
+        size_t mask = _capacity - 1;
+        size_t liveCount = 0;
+        for (size_t i = 0; i < _capacity; ++i)
+        {
+            Mixin* entry = _entries[i];
+            if (!entry)
+                continue;
+
+            if (!isLive(entry))
+            {
+                delete entry;
+                releasedSize += sizeof(Mixin);
+                continue;
+            }
+
+            size_t index = hashKey(entry->_decl, entry->_origin, entry->_next) & mask;
+            while (newEntries[index])
+                index = (index + 1) & mask;
+            newEntries[index] = entry;
+            liveCount++;
+        }
+
+        free(_entries);
+        _entries = newEntries;
+        _count = liveCount;
+        _mixinBytes -= releasedSize;
+        return releasedSize;
+    }
+
+    Count getMixinCount() const { return Count(_count); }
+
+    Count getLookupCount() const { return _lookupCount; }
+    Count getHitCount() const { return _hitCount; }
+
+    double getHitRate() const
+    {
+        return _lookupCount ? double(_hitCount) / double(_lookupCount) : 0.0;
+    }
+
+        // Total bytes used by cached mixins plus the table itself
+    Size getMemoryUsage() const
+    {
+        return _mixinBytes + _capacity * sizeof(Mixin*);
+    }
+
+private:
+    static size_t hashKey(DeclIndex decl, Part* origin, Mixin* next)
+    {
+        size_t hash = size_t(decl);
+        hash = hash * 31 + size_t(origin);
+        hash = hash * 31 + size_t(next);
+        return hash ^ (hash >> 17);
+    }
+
+    void grow()
+    {
+        size_t oldCapacity = _capacity;
+        Mixin** oldEntries = _entries;
+
+        size_t newCapacity = oldCapacity ? oldCapacity * 2 : 64;
+        Mixin** newEntries = (Mixin**) calloc(newCapacity, sizeof(Mixin*));
+        if (!newEntries)
+            throw std::bad_alloc();
+
+        size_t mask = newCapacity - 1;
+        for (size_t i = 0; i < oldCapacity; ++i)
+        {
+            Mixin* entry = oldEntries[i];
+            if (!entry)
+                continue;
+
+            size_t index = hashKey(entry->_decl, entry->_origin, entry->_next) & mask;
+            while (newEntries[index])
+                index = (index + 1) & mask;
+            newEntries[index] = entry;
+        }
+
+        free(oldEntries);
+        _entries = newEntries;
+        _capacity = newCapacity;
+    }
+
+    Mixin** _entries = nullptr;
+    size_t _capacity = 0;
+    size_t _count = 0;
+
+    Count _lookupCount = 0;
+    Count _hitCount = 0;
+    Size _mixinBytes = 0;
+};
+
+    // Inline caches for the instructions of a program that need to
+    // find something in a part based on the mixin it was created
+    // from, such as `GetBasePart`.
+    //
+    // The same instruction can see parts from different mixin chains
+    // (since patterns can be composed at run time), but in practice
+    // most only ever see one or a few. Each cache remembers the
+    // answer for up to `kEntryCount` mixins, and once it is full
+    // each miss replaces the oldest entry.
+    //
+    // An answer is the offset from the part the instruction was
+    // given to the part it was looking for, which depends only on
+    // the mixin of the given part.
+    //
+struct InlineCacheTable
+{
+public:
+    enum
+    {
+        kEntryCount = 4,
+    };
+
+    struct Entry
+    {
+        Mixin* _mixin = nullptr;
+        Int _partDelta = 0;
+    };
+
+    struct Cache
+    {
+        Entry _entries[kEntryCount];
+        Index _nextEntry = 0;
+    };
+
+        // Make room for `count` empty caches
+    void reset(Count count)
+    {
+        _caches.clear();
+        _caches.resize(count);
+    }
+
+        // The entry for `mixin` in cache `cacheIndex`, if there is one
+    Entry const* find(Index cacheIndex, Mixin* mixin)
+    {
+        Cache& cache = _caches[cacheIndex];
+        for (auto const& entry : cache._entries)
+        {
+            if (entry._mixin == mixin)
+            {
+                _hitCount++;
+                return &entry;
+            }
+        }
+        _missCount++;
+        return nullptr;
+    }
+
+    void add(Index cacheIndex, Mixin* mixin, Int partDelta)
+    {
+        Cache& cache = _caches[cacheIndex];
+        Entry& entry = cache._entries[cache._nextEntry];
+        entry._mixin = mixin;
+        entry._partDelta = partDelta;
+        cache._nextEntry = (cache._nextEntry + 1) % kEntryCount;
+    }
+
+        // Drop every entry for which `isLive(mixin)` returns `false`,
+        // since its mixin is about to be deleted (and its address
+        // could be re-used by a different one).
+    template<typename F>
+    void sweep(F const& isLive)
+    {
+        for (auto& cache : _caches)
+        {
+            for (auto& entry : cache._entries)
+            {
+                if (entry._mixin && !isLive(entry._mixin))
+                    entry = Entry();
+            }
+        }
+    }
+
+    Count getCacheCount() const { return Count(_caches.size()); }
+
+    Count getHitCount() const { return _hitCount; }
+    Count getMissCount() const { return _missCount; }
+
+    double getHitRate() const
+    {
+        Count lookupCount = _hitCount + _missCount;
+        return lookupCount ? double(_hitCount) / double(lookupCount) : 0.0;
+    }
+
+private:
+    std::vector<Cache> _caches;
+
+    Count _hitCount = 0;
+    Count _missCount = 0;
+};
+
 class VM
 {
 public:
+    VM()
+    {}
+
+    VM(VM const&) = delete;
+    VM& operator=(VM const&) = delete;
+
+    ~VM()
+    {
+        while (_frame)
+            popFrame();
+
+        while (auto frame = _freeFrames)
+        {
+            _freeFrames = frame->_parent;
+            delete frame;
+        }
+
+        free(_stack);
+    }
+
     struct Frame
     {
-        BCDecl const* _decl;
-        CodeChunk const* _chunk;
+        DeclIndex _decl;
         Byte const* _ip;
-        std::vector<Value> _stack;
         Part* _self;
 
+            // The constants that `Constant` ops in this frame's code
+            // index into
+        Value const* _constants;
+
+            // Index in the VM value stack where this frame's values start.
+            //
+            // Frames are windows into the one value stack owned by the
+            // VM, and we use an index rather than a pointer so that the
+            // stack can be grown without invalidating them.
+        Index _stackBase = 0;
+
         Frame* _parent = nullptr;
     };
 
     Frame* _frame = nullptr;
 
+        // Frames that have been popped, and are available for re-use
+    Frame* _freeFrames = nullptr;
+
+        // Storage for the objects created by this VM
+    ObjectHeap _objectHeap;
+
+        // Mixins created by this VM, shared between identical patterns
+    MixinCache _mixinCache;
+
+        // The inline caches for the program being run
+    InlineCacheTable _inlineCaches;
+
+        // The program being run
+    LinkedProgram _program;
+
+        // The value stack shared by all frames
+    Value* _stack = nullptr;
+    Value* _stackTop = nullptr;
+    Value* _stackEnd = nullptr;
+
+    enum
+    {
+        kInitialStackSize = 256,
+        kInitialGCThreshold = 4 * 1024 * 1024,
+    };
+
+    struct GCStats
+    {
+        Count collectionCount = 0;
+
+            // Bytes of objects and mixins released, in total and by the last collection
+        Size totalBytesReclaimed = 0;
+        Size lastBytesReclaimed = 0;
+
+            // Wall-clock time spent in collections, in milliseconds
+        double totalPauseTime = 0;
+        double maxPauseTime = 0;
+        double lastPauseTime = 0;
+    };
+    GCStats _gcStats;
+
+        // A collection is triggered once the bytes in use by objects
+        // and mixins reach this threshold.
+    Size _gcThreshold = kInitialGCThreshold;
+
+        // When set, collect at every allocation point (for testing the collector)
+    bool _gcStressMode = false;
+
+        // Values that host code is holding on to, which must be
+        // treated as roots by the collector.
+    std::vector<Value> _hostRoots;
+
+    struct WithRoot
+    {
+        WithRoot(VM* vm, Value value)
+            : _vm(vm)
+        {
+            _vm->_hostRoots.push_back(value);
+        }
+
+        ~WithRoot()
+        {
+            _vm->_hostRoots.pop_back();
+        }
+
+        VM* _vm;
+    };
+
+        // Work lists for the mark phase, kept around to avoid re-allocating
+    std::vector<Object*> _objectMarkStack;
+    std::vector<Mixin*> _mixinMarkStack;
+
+    Size getHeapSize()
+    {
+        return _objectHeap.getAllocatedSize() + _mixinCache.getMemoryUsage();
+    }
+
+        // Called at points where the VM is about to allocate, and all
+        // the live values are reachable from roots.
+    void maybeCollectGarbage()
+    {
+        if (_gcStressMode || getHeapSize() >= _gcThreshold)
+            collectGarbage();
+    }
+
+    void collectGarbage()
+    {
+        auto startTime = std::chrono::steady_clock::now();
+
+        markRoots();
+        processMarkStacks();
+
+        Size releasedSize = 0;
+        releasedSize += _objectHeap.sweep([](void* cell)
+        {
+            Object* object = (Object*) cell;
+            if (!object->_isMarked)
+                return false;
+            object->_isMarked = false;
+            return true;
+        });
+        _inlineCaches.sweep([](Mixin* mixin)
+        {
+            return mixin->_isMarked;
+        });
+        releasedSize += _mixinCache.sweep([](Mixin* mixin)
+        {
+            if (!mixin->_isMarked)
+                return false;
+            mixin->_isMarked = false;
+            return true;
+        });
+
+        // Let the heap grow to twice what survived before we collect again
+        Size liveSize = getHeapSize();
+        _gcThreshold = 2 * liveSize > Size(kInitialGCThreshold) ? 2 * liveSize : Size(kInitialGCThreshold);
+
+        auto endTime = std::chrono::steady_clock::now();
+        double pauseTime = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+
+        _gcStats.collectionCount++;
+        _gcStats.lastBytesReclaimed = releasedSize;
+        _gcStats.totalBytesReclaimed += releasedSize;
+        _gcStats.lastPauseTime = pauseTime;
+        _gcStats.totalPauseTime += pauseTime;
+        if (pauseTime > _gcStats.maxPauseTime)
+            _gcStats.maxPauseTime = pauseTime;
+    }
+
+    void dumpGCStats()
+    {
+        fprintf(stderr, "gc: %lld collections, %zu bytes reclaimed, pause %.3f ms total, %.3f ms max\n",
+            (long long) _gcStats.collectionCount,
+            size_t(_gcStats.totalBytesReclaimed),
+            _gcStats.totalPauseTime,
+            _gcStats.maxPauseTime);
+    }
+
+    void markRoots()
+    {
+        for (Value* v = _stack; v != _stackTop; ++v)
+        {
+            markValue(*v);
+        }
+
+        for (Frame* frame = _frame; frame; frame = frame->_parent)
+        {
+            if (auto self = frame->_self)
+                markObject(self->getObject());
+        }
+
+        for (auto value : _hostRoots)
+        {
+            markValue(value);
+        }
+    }
+
+    void markValue(Value value)
+    {
+        // Immediate integers don't refer to anything
+        if (!value.isObj())
+            return;
+
+        auto obj = value.getPtr();
+
+        // Note: symbols and the empty pattern are not owned by the collector
+        if (auto part = as<Part>(obj))
+        {
+            markObject(part->getObject());
+        }
+        else if (auto object = as<Object>(obj))
+        {
+            markObject(object);
+        }
+        else if (auto mixin = as<Mixin>(obj))
+        {
+            markMixin(mixin);
+        }
+    }
+
+    void markObject(Object* object)
+    {
+        if (object->_isMarked)
+            return;
+        object->_isMarked = true;
+        _objectMarkStack.push_back(object);
+    }
+
+    void markMixin(Mixin* mixin)
+    {
+        if (mixin->_isMarked)
+            return;
+        mixin->_isMarked = true;
+        _mixinMarkStack.push_back(mixin);
+    }
+
+        // Trace everything reachable from the marked objects and mixins.
+        //
+        // We use explicit work lists rather than recursion, since
+        // object graphs can be arbitrarily deep.
+        //
+    void processMarkStacks()
+    {
+        for (;;)
+        {
+            if (!_objectMarkStack.empty())
+            {
+                Object* object = _objectMarkStack.back();
+                _objectMarkStack.pop_back();
+
+                // The mixins of the object's parts are all on the
+                // chain that starts at its pattern.
+                //
+                if (auto mixin = as<Mixin>(object->getPattern()))
+                    markMixin(mixin);
+
+                for (auto part : object->getParts())
+                {
+                    for (auto slotValue : part->getSlots())
+                    {
+                        markValue(slotValue);
+                    }
+                }
+            }
+            else if (!_mixinMarkStack.empty())
+            {
+                Mixin* mixin = _mixinMarkStack.back();
+                _mixinMarkStack.pop_back();
+
+                if (auto origin = mixin->_origin)
+                    markObject(origin->getObject());
+
+                if (auto next = mixin->_next)
+                    markMixin(next);
+            }
+            else
+            {
+                return;
+            }
+        }
+    }
+
+        // Link `bcProgram` and make it the program that this VM
+        // runs, returning the pattern for the program itself.
+        //
+        // Mixins refer to decls by their index in the linked program,
+        // so a VM can only ever load one program.
+        //
     Pattern* loadProgram(BCDecl* bcProgram)
     {
-        Mixin* mixin = new Mixin(bcProgram, nullptr, nullptr);
+        assert(_program.getDeclCount() == 0);
+
+        _program.link(bcProgram);
+        _inlineCaches.reset(_program.getInlineCacheCount());
+
+        Mixin* mixin = getMixin(0, nullptr, nullptr);
         return mixin;
     }
 
-    void pushFrame(BCDecl const* decl, CodeChunk const* chunk, Part* part)
+        // The mixin for `decl` with the given origin and next link
+    Mixin* getMixin(DeclIndex decl, Part* origin, Mixin* next)
+    {
+        return _mixinCache.getMixin(decl, _program.getSlotCount(decl), origin, next);
+    }
+
+    Frame* allocateFrame()
+    {
+        if (auto frame = _freeFrames)
+        {
+            _freeFrames = frame->_parent;
+            return frame;
+        }
+        return new Frame();
+    }
+
+    void pushBodyFrame(DeclIndex decl, Part* part)
     {
-        Frame* frame = new Frame();
+        Frame* frame = allocateFrame();
         frame->_decl = decl;
-        frame->_chunk = chunk;
-        frame->_ip = chunk->_bytes.data();
+        frame->_ip = _program.getBodyCode(decl);
         frame->_self = part;
+        frame->_constants = _program.getBodyConstants(decl);
+        frame->_stackBase = _stackTop - _stack;
 
         frame->_parent = _frame;
         _frame = frame;
@@ -677,7 +1588,30 @@ public:
 
     void popFrame()
     {
-        _frame = _frame->_parent;
+        Frame* frame = _frame;
+
+        // Any values the frame left behind are discarded along with it
+        _stackTop = _stack + frame->_stackBase;
+
+        _frame = frame->_parent;
+
+        frame->_parent = _freeFrames;
+        _freeFrames = frame;
+    }
+
+    void growStack()
+    {
+        Count oldSize = _stackEnd - _stack;
+        Count newSize = oldSize ? oldSize * 2 : kInitialStackSize;
+        Count depth = _stackTop - _stack;
+
+        Value* newStack = (Value*) realloc(_stack, newSize * sizeof(Value));
+        if (!newStack)
+            throw std::bad_alloc();
+
+        _stack = newStack;
+        _stackTop = newStack + depth;
+        _stackEnd = newStack + newSize;
     }
 
     void initializePart(Part* part, Mixin* mixin)
@@ -688,21 +1622,63 @@ public:
         // iterate over the members, and initialize them
         // based on their provided logic...
 
-        for( auto member : mixin->getMembers() )
-        {
-            pushFrame(member, &member->initCode, part);
+        Frame* exitFrame = _frame;
+        FrameChain chain;
+        pushInitFrames(chain, part, mixin);
+        pushFrames(chain);
 
-            execute();
-        }
+        // A part whose decl has no members gets no init frame, and
+        // then there is nothing to run.
+        //
+        if (_frame != exitFrame)
+            execute(exitFrame);
+    }
+
+        // A sequence of frames that have been set up to run in
+        // order, but not yet pushed onto the VM.
+    struct FrameChain
+    {
+        Frame* _first = nullptr;
+        Frame* _last = nullptr;
+    };
+
+        // Add a frame to `chain` that runs the initialization of
+        // all the members of `part` (if there are any).
+    void pushInitFrames(FrameChain& chain, Part* part, Mixin* mixin)
+    {
+        auto decl = mixin->getDecl();
+        if (!_program.hasPartInitCode(decl))
+            return;
+
+        Frame* frame = allocateFrame();
+        frame->_decl = decl;
+        frame->_ip = _program.getPartInitCode(decl);
+        frame->_self = part;
+        frame->_constants = _program.getPartInitConstants(decl);
+        frame->_stackBase = _stackTop - _stack;
+        frame->_parent = nullptr;
 
+        if (chain._last)
+            chain._last->_parent = frame;
+        else
+            chain._first = frame;
+        chain._last = frame;
     }
 
-    Object* createObject(SimplePattern* pattern)
+        // Push all the frames in `chain`, so that the first one
+        // will run next, and each one returns into the one after it.
+    void pushFrames(FrameChain const& chain)
     {
-        Size instanceSize = pattern->getInstanceSize();
+        if (!chain._first)
+            return;
+
+        chain._last->_parent = _frame;
+        _frame = chain._first;
+    }
 
-        void* objectMemory = malloc(instanceSize);
-        memset(objectMemory, 0, instanceSize);
+    Object* allocateObject(SimplePattern* pattern)
+    {
+        void* objectMemory = _objectHeap.allocate(pattern);
 
         // Run constructors to get things into a basic
         // constructed-but-unitinitialized state.
@@ -714,41 +1690,44 @@ public:
             Part* part = new(partMemory) Part(mixin);
         }
 
-        // Now run per-part initialization logic.
-        //
-        // Note: we run the code on a sub-VM because this one
-        // could already be executing code on its stack, and
-        // could be creating an object as part of implementing
-        // one of its opcodes.
-        //
-        // TODO: make the `createObject()` path be "stackless"
-        // so that it can run the initialization code of sub-objects
-        // directly on the stack.
-        //
-        // E.g., we could have this code push all the necessary
-        // frames (might need to be in the reverse of the order given
-        // here...) and then return the object *without* calling
-        // `execute()`, so that resuming the VM would automatically
-        // run all those frames in order (each returning to the next).
+        return object;
+    }
+
+        // Schedule the per-part initialization logic of `object`.
         //
-        // Alternatively, the init code for each member could have built-in
-        // logic to jump to the initialization of the next member (or just
-        // concatenate them, of course...).
+        // This doesn't run anything: it pushes one frame per part,
+        // running the part init code that the linker fused from the
+        // init code of the members of the part's decl (so that the
+        // parts initialize in order, each returning to the next), and
+        // the initialization happens when the VM resumes. A part whose
+        // decl has no members gets no frame. This keeps object construction inside
+        // the one dispatch loop, so that nested object declarations
+        // don't recurse on the native stack.
         //
-        VM subVM;
+    void pushObjectInitFrames(Object* object)
+    {
+        FrameChain chain;
         for (auto part : object->getParts())
         {
-            auto mixin = part->getMixin();
-
-            for (auto member : mixin->getMembers())
-            {
-                subVM.pushFrame(member, &member->initCode, part);
-                subVM.execute();
-            }
+            pushInitFrames(chain, part, part->getMixin());
         }
+        pushFrames(chain);
 
         // TODO: We logically want to run the "do" part of
         // the object here as well...
+    }
+
+    Object* createObject(SimplePattern* pattern)
+    {
+        WithRoot patternRoot(this, pattern);
+        maybeCollectGarbage();
+
+        Object* object = allocateObject(pattern);
+
+        Frame* exitFrame = _frame;
+        pushObjectInitFrames(object);
+        if (_frame != exitFrame)
+            execute(exitFrame);
 
         return object;
     }
@@ -780,9 +1759,11 @@ public:
         //
         auto part = object->getFirstPart();
         auto decl = part->getDecl();
-        pushFrame(decl, &decl->bodyCode, part);
 
-        execute();
+        Frame* exitFrame = _frame;
+        pushBodyFrame(decl, part);
+
+        execute(exitFrame);
     }
 
     void execute(BCDecl* bcProgram)
@@ -792,11 +1773,12 @@ public:
         auto pattern = loadProgram(bcProgram);
         auto object = createObject(pattern);
 
+        WithRoot objectRoot(this, object);
         runObject(object);
 
         // TODO: now run the `do` part of `object`
 
-        dumpObject(object);
+        dumpObject(object, &_program);
     }
 
     Byte readByte()
@@ -804,11 +1786,6 @@ public:
         return *_frame->_ip++;
     }
 
-    unsigned int readUInt()
-    {
-        return readByte();
-    }
-
     Opcode readOpcode()
     {
         return Opcode(readByte());
@@ -816,38 +1793,209 @@ public:
 
     Value getConstant(unsigned int index)
     {
-        return _frame->_chunk->_constants[index];
+        return _frame->_constants[index];
     }
 
-    Value readConstant()
+    void push(Value value)
     {
-        return getConstant(readUInt());
+        if (_stackTop == _stackEnd)
+            growStack();
+        *_stackTop++ = value;
     }
 
-    void push(Value value)
+    Value pop()
     {
-        _frame->_stack.push_back(value);
+        assert(_stackTop > _stack + _frame->_stackBase);
+        return *--_stackTop;
     }
 
-    Value pop()
+        // The part of the same object as `part` for base `baseIndex`
+        // of its mixin, using (and filling in) inline cache
+        // `cacheIndex`
+        //
+    Part* getBasePart(Part* part, Index baseIndex, Index cacheIndex)
     {
-        Value result = _frame->_stack.back();
-        _frame->_stack.pop_back();
-        return result;
+        Mixin* mixin = part->getMixin();
+        if (auto entry = _inlineCaches.find(cacheIndex, mixin))
+            return (Part*)((char*) part + entry->_partDelta);
+
+        Mixin* baseMixin = findBaseMixin(mixin, baseIndex);
+        Int partDelta = Int(baseMixin->getPartOffset()) - Int(mixin->getPartOffset());
+        _inlineCaches.add(cacheIndex, mixin, partDelta);
+        return (Part*)((char*) part + partDelta);
+    }
+
+        // The mixin in the chain after `mixin` for its base
+        // `baseIndex`.
+        //
+        // Only single inheritance is supported so far, and a mixin
+        // is always created on top of the pattern for its one base,
+        // so that is just the next mixin in the chain.
+        //
+    Mixin* findBaseMixin(Mixin* mixin, Index baseIndex)
+    {
+        if (baseIndex != 0 || !mixin->_next)
+            error(SourceLoc(), "part has no base %d", int(baseIndex));
+        return mixin->_next;
+    }
+
+        // The part `levelCount` levels out from `part`
+    Part* getOuterPart(Part* part, unsigned int levelCount)
+    {
+        for (unsigned int i = 0; i < levelCount; i++)
+            part = part->_mixin->_origin;
+        return part;
+    }
+
+        // Execute the instruction after a `Wide` prefix.
+        //
+        // Wide operands are rare enough that it is better to keep
+        // them out of the main loop entirely than to have every op
+        // with an operand check for them.
+        //
+    void executeWide()
+    {
+        Opcode opcode = readOpcode();
+        unsigned int operand = decodeWideOperand(_frame->_ip);
+
+        switch (opcode)
+        {
+        case Opcode::Constant:
+            push(getConstant(operand));
+            break;
+
+        case Opcode::SetPartSlot:
+            {
+                auto value = pop();
+                auto part = (Part*) pop().getObj();
+                part->setSlot(operand, value);
+            }
+            break;
+
+        case Opcode::GetPartSlot:
+            {
+                auto part = (Part*) pop().getObj();
+                push(part->getSlot(operand));
+            }
+            break;
+
+        case Opcode::GetSelfSlot:
+            push(_frame->_self->getSlot(operand));
+            break;
+
+        case Opcode::SetSelfSlot:
+            _frame->_self->setSlot(operand, pop());
+            break;
+
+        case Opcode::GetOuterSlot:
+            {
+                auto slotIndex = decodeWideOperand(_frame->_ip);
+                push(getOuterPart(_frame->_self, operand)->getSlot(slotIndex));
+            }
+            break;
+
+        case Opcode::GetOuterPart:
+            push(getOuterPart(_frame->_self, operand));
+            break;
+
+        case Opcode::GetOuterPartOf:
+            push(getOuterPart((Part*) pop().getObj(), operand));
+            break;
+
+        case Opcode::GetBasePart:
+            {
+                auto cacheIndex = decodeWideOperand(_frame->_ip);
+                auto part = (Part*) pop().getObj();
+                push(getBasePart(part, operand, cacheIndex));
+            }
+            break;
+
+        case Opcode::CreateMemberPattern:
+            {
+                maybeCollectGarbage();
+
+                auto member = _program.getMember(_frame->_decl, operand);
+                push(getMixin(member, _frame->_self, nullptr));
+            }
+            break;
+
+        case Opcode::CreateMemberPatternFromBase:
+            {
+                maybeCollectGarbage();
+
+                auto basePattern = (Mixin*) pop().getObj();
+                auto member = _program.getMember(_frame->_decl, operand);
+                push(getMixin(member, _frame->_self, basePattern));
+            }
+            break;
+
+        default:
+            error(SourceLoc(), "invalid opcode after wide prefix");
+            break;
+        }
     }
 
-    void execute()
+        // Run until the frame that was current when the frames
+        // to execute were pushed (`exitFrame`) is current again.
+        //
+        // The instruction and stack pointers are cached in locals
+        // while we run, and are only written back to the VM (and
+        // re-read from it) around operations that push/pop frames
+        // or could grow the stack.
+        //
+        // Depending on `THETA_USE_COMPUTED_GOTO`, the opcode bodies below
+        // are either dispatched by direct threading (jumping through a
+        // table of label addresses at the end of every op), or by a
+        // portable `switch` in a loop.
+        //
+    void execute(Frame* exitFrame)
     {
+        Byte const* ip = _frame->_ip;
+        Value* sp = _stackTop;
+
+#define VM_SAVE()   do { _frame->_ip = ip; _stackTop = sp; } while(0)
+#define VM_LOAD()   do { ip = _frame->_ip; sp = _stackTop; } while(0)
+
+#define VM_READ_UINT()  (unsigned int)(*ip++)
+#define VM_POP()        (assert(sp > _stack + _frame->_stackBase), *--sp)
+#define VM_PUSH(VALUE)                  \
+        do {                            \
+            Value _value = (VALUE);     \
+            if (sp == _stackEnd)        \
+            {                           \
+                _stackTop = sp;         \
+                growStack();            \
+                sp = _stackTop;         \
+            }                           \
+            *sp++ = _value;             \
+        } while(0)
+
+#if THETA_USE_COMPUTED_GOTO
+        static void* const kDispatchTable[] =
+        {
+#define OPCODE_LABEL(NAME) &&op_##NAME,
+            FOREACH_OPCODE(OPCODE_LABEL)
+#undef OPCODE_LABEL
+        };
+
+#define VM_CASE(NAME)   op_##NAME:
+#define VM_DEFAULT
+#define VM_NEXT()       do { assert(*ip < kOpcodeCount); goto *kDispatchTable[*ip++]; } while(0)
+
+        VM_NEXT();
+#else
+#define VM_CASE(NAME)   case Opcode::NAME:
+#define VM_DEFAULT      default:
+#define VM_NEXT()       continue
+
         for( ;;)
         {
-            Opcode opcode = readOpcode();
+            Opcode opcode = Opcode(*ip++);
             switch( opcode )
             {
-            default:
-                error(SourceLoc(), "invalid opcode");
-                return;
+#endif
 
-            case Opcode::Inner:
+            VM_CASE(Inner)
                 {
                     auto currentPart = _frame->_self;
                     auto currentMixin = currentPart->getMixin();
@@ -859,110 +2007,242 @@ public:
                         auto innerPart = object->getPartForMixin(innerMixin);
 
                         auto innerDecl = innerPart->getDecl();
-                        pushFrame(innerDecl, &innerDecl->bodyCode, innerPart);
+
+                        VM_SAVE();
+                        pushBodyFrame(innerDecl, innerPart);
+                        VM_LOAD();
                     }
                 }
-                break;
+                VM_NEXT();
 
-            case Opcode::Nop:
-                break;
+            VM_CASE(Nop)
+                VM_NEXT();
 
-            case Opcode::Pop:
-                pop();
-                break;
-
-            case Opcode::Constant:
-                push(readConstant());
-                break;
+            VM_CASE(Pop)
+                VM_POP();
+                VM_NEXT();
 
+            VM_CASE(Constant)
+                {
+                    auto constantIndex = VM_READ_UINT();
+                    VM_PUSH(_frame->_constants[constantIndex]);
+                }
+                VM_NEXT();
 
-            case Opcode::Return:
+            VM_CASE(Return)
                 {
+                    VM_SAVE();
                     popFrame();
-                    if (!_frame)
+                    if (_frame == exitFrame)
                         return;
+                    VM_LOAD();
                 }
-                break;
+                VM_NEXT();
 
-            case Opcode::CreateObject:
+            VM_CASE(CreateObject)
                 {
-                    auto pattern = (Pattern*) pop().getPtr();
-                    auto object = createObject(pattern);
-                    push(object);
+                    VM_SAVE();
+                    maybeCollectGarbage();
+
+                    // The new object goes on the stack first, and
+                    // then its initialization frames are pushed above
+                    // it, so that they run before this frame resumes.
+                    //
+                    auto pattern = (Pattern*) VM_POP().getObj();
+                    auto object = allocateObject(pattern->getSimplePattern());
+                    VM_PUSH(object);
+
+                    VM_SAVE();
+                    pushObjectInitFrames(object);
+                    VM_LOAD();
                 }
-                break;
+                VM_NEXT();
 
-            case Opcode::SetPartSlot:
+            VM_CASE(SetPartSlot)
                 {
-                    auto slotIndex = readUInt();
-                    auto value = pop();
-                    auto part = (Part*) pop().getPtr();
+                    auto slotIndex = VM_READ_UINT();
+                    auto value = VM_POP();
+                    auto part = (Part*) VM_POP().getObj();
 
                     part->setSlot(slotIndex, value);
                 }
-                break;
+                VM_NEXT();
 
-            case Opcode::GetPartSlot:
+            VM_CASE(GetPartSlot)
                 {
-                    auto slotIndex = readUInt();
-                    auto part = (Part*) pop().getPtr();
+                    auto slotIndex = VM_READ_UINT();
+                    auto part = (Part*) VM_POP().getObj();
 
                     auto value = part->getSlot(slotIndex);
-                    push(value);
+                    VM_PUSH(value);
+                }
+                VM_NEXT();
+
+            VM_CASE(GetSelfSlot)
+                {
+                    auto slotIndex = VM_READ_UINT();
+                    VM_PUSH(_frame->_self->getSlot(slotIndex));
+                }
+                VM_NEXT();
+
+            VM_CASE(SetSelfSlot)
+                {
+                    auto slotIndex = VM_READ_UINT();
+                    auto value = VM_POP();
+                    _frame->_self->setSlot(slotIndex, value);
                 }
-                break;
+                VM_NEXT();
 
-            case Opcode::CreatePatternFromMainPart:
+            VM_CASE(GetOuterSlot)
                 {
-                    auto mixin = new Mixin(_frame->_decl, _frame->_self, nullptr);
+                    auto levelCount = VM_READ_UINT();
+                    auto slotIndex = VM_READ_UINT();
+
+                    auto part = getOuterPart(_frame->_self, levelCount);
 
-                    push(mixin);
+                    VM_PUSH(part->getSlot(slotIndex));
                 }
-                break;
+                VM_NEXT();
 
-            case Opcode::CreatePatternFromBaseAndMainPart:
+            VM_CASE(GetOuterPart)
                 {
+                    auto levelCount = VM_READ_UINT();
+
+                    auto part = getOuterPart(_frame->_self, levelCount);
+
+                    VM_PUSH(part);
+                }
+                VM_NEXT();
+
+            VM_CASE(GetOuterPartOf)
+                {
+                    auto levelCount = VM_READ_UINT();
+                    auto part = (Part*) VM_POP().getObj();
+                    VM_PUSH(getOuterPart(part, levelCount));
+                }
+                VM_NEXT();
+
+            VM_CASE(CreatePatternFromMainPart)
+                {
+                    VM_SAVE();
+                    maybeCollectGarbage();
+
+                    auto mixin = getMixin(_frame->_decl, _frame->_self, nullptr);
+
+                    VM_PUSH(mixin);
+                }
+                VM_NEXT();
+
+            VM_CASE(CreatePatternFromBaseAndMainPart)
+                {
+                    VM_SAVE();
+                    maybeCollectGarbage();
+
                     // TODO: We need to handle any cases that do *not* evaluate to
                     // a mixin-based pattern elsewhere...
 
-                    auto basePattern = (Mixin*) pop().getPtr();
+                    auto basePattern = (Mixin*) VM_POP().getObj();
 
-                    auto pattern = new Mixin(_frame->_decl, _frame->_self, basePattern);
+                    auto pattern = getMixin(_frame->_decl, _frame->_self, basePattern);
 
-                    push(pattern);
+                    VM_PUSH(pattern);
                 }
-                break;
+                VM_NEXT();
 
-            case Opcode::GetEmptyPattern:
+            VM_CASE(CreateMemberPattern)
+                {
+                    auto memberIndex = VM_READ_UINT();
+
+                    VM_SAVE();
+                    maybeCollectGarbage();
+
+                    auto member = _program.getMember(_frame->_decl, memberIndex);
+                    auto mixin = getMixin(member, _frame->_self, nullptr);
+
+                    VM_PUSH(mixin);
+                }
+                VM_NEXT();
+
+            VM_CASE(CreateMemberPatternFromBase)
+                {
+                    auto memberIndex = VM_READ_UINT();
+
+                    VM_SAVE();
+                    maybeCollectGarbage();
+
+                    auto basePattern = (Mixin*) VM_POP().getObj();
+
+                    auto member = _program.getMember(_frame->_decl, memberIndex);
+                    auto pattern = getMixin(member, _frame->_self, basePattern);
+
+                    VM_PUSH(pattern);
+                }
+                VM_NEXT();
+
+            VM_CASE(GetEmptyPattern)
                 {
                     auto pattern = EmptyPattern::get();
-                    push(pattern);
+                    VM_PUSH(pattern);
                 }
-                break;
+                VM_NEXT();
 
-            case Opcode::GetSelfPart:
+            VM_CASE(GetSelfPart)
                 {
-                    push(_frame->_self);
+                    VM_PUSH(_frame->_self);
                 }
-                break;
+                VM_NEXT();
 
-            case Opcode::GetMixinFromPart:
+            VM_CASE(GetMixinFromPart)
                 {
-                    auto part = (Part*) pop().getPtr();
+                    auto part = (Part*) VM_POP().getObj();
                     auto mixin = part->_mixin;
-                    push(mixin);
+                    VM_PUSH(mixin);
                 }
-                break;
+                VM_NEXT();
 
-            case Opcode::GetOriginPartFromMixin:
+            VM_CASE(GetOriginPartFromMixin)
                 {
-                    auto mixin = (Mixin*) pop().getPtr();
+                    auto mixin = (Mixin*) VM_POP().getObj();
                     auto part = mixin->_origin;
-                    push(part);
+                    VM_PUSH(part);
+                }
+                VM_NEXT();
+
+            VM_CASE(GetBasePart)
+                {
+                    auto baseIndex = VM_READ_UINT();
+                    auto cacheIndex = VM_READ_UINT();
+                    auto part = (Part*) VM_POP().getObj();
+                    VM_PUSH(getBasePart(part, baseIndex, cacheIndex));
                 }
-                break;
+                VM_NEXT();
+
+            VM_CASE(Wide)
+                VM_SAVE();
+                executeWide();
+                VM_LOAD();
+                VM_NEXT();
+
+            VM_CASE(GetObjectFromPart)
+            VM_CASE(GetPartFromObject)
+            VM_DEFAULT
+                VM_SAVE();
+                error(SourceLoc(), "invalid opcode");
+                return;
+
+#if !THETA_USE_COMPUTED_GOTO
             }
         }
+#endif
+
+#undef VM_CASE
+#undef VM_DEFAULT
+#undef VM_NEXT
+#undef VM_PUSH
+#undef VM_POP
+#undef VM_READ_UINT
+#undef VM_LOAD
+#undef VM_SAVE
     }
 
 private: